@@ -0,0 +1,89 @@
+/*
+ * Micro benchmark of GPRSbeeFields, the parser of the SIMx00 replies.
+ *
+ * This runs on the host, not on the Arduino.  It parses a few typical
+ * replies over and over, with GPRSbeeFields and with the fixed offset
+ * strtoul code that it replaced.
+ *
+ *   g++ -O2 -I../src bench_fields.cpp ../src/GPRSbeeFields.cpp -o bench_fields
+ *   ./bench_fields
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "GPRSbeeFields.h"
+
+#define LOOPS   2000000
+
+// The types of the fields: i = number, p = IP address
+static const struct {
+  const char *line;
+  const char *types;
+} lines[] = {
+  { "+CSQ: 18,0", "ii" },
+  { "+HTTPACTION: 0,200,1234", "iii" },
+  { "+CIPRXGET: 2,512,0", "iii" },
+  { "+SAPBR: 1,1,\"10.81.112.23\"", "iip" },
+};
+
+static volatile int32_t sink;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void parseFields(char *line, const char *types)
+{
+  GPRSbeeFields fields(line);
+  int32_t value;
+  uint32_t ip;
+  for (; *types; ++types) {
+    if (*types == 'p' ? fields.nextIP(&ip) : fields.nextInt(&value)) {
+      sink = *types == 'p' ? ip : value;
+    }
+  }
+}
+
+// The way it was done before, only good for the integer fields
+static void parseOffsets(char *line, const char * /* types */)
+{
+  char *ptr = strchr(line, ':') + 1;
+  while (*ptr == ' ') {
+    ++ptr;
+  }
+  for (;;) {
+    sink = strtoul(ptr, &ptr, 10);
+    if (*ptr != ',') {
+      break;
+    }
+    ++ptr;
+  }
+}
+
+static void run(const char *name, void (*parse)(char *line, const char *types))
+{
+  char buffer[64];
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+    double start = now();
+    for (long n = 0; n < LOOPS; ++n) {
+      // The parser may change the line, so start with a fresh copy
+      strcpy(buffer, lines[i].line);
+      parse(buffer, lines[i].types);
+    }
+    double ns = (now() - start) * 1e9 / LOOPS;
+    printf("%-8s %-30s %6.1f ns\n", name, lines[i].line, ns);
+  }
+}
+
+int main()
+{
+  run("fields", parseFields);
+  run("offsets", parseOffsets);
+  return 0;
+}
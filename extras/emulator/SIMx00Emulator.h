@@ -0,0 +1,381 @@
+/*
+ * A scripted SIM800/SIM900 for the host, to be used as the modem Stream
+ * of GPRSbee.
+ *
+ * It answers the AT commands that GPRSbee sends, with the replies of the
+ * real modem, after a fixed latency. Time is taken from millis(), which
+ * is expected to be a virtual clock: each read() on an empty input
+ * advances it with delay(1).  This way a benchmark measures the time that
+ * the library spends waiting for the modem, not the speed of the host.
+ *
+ * A test can change the answer of any command with hook, and can let the
+ * modem say something spontaneously (an URC) with reply().
+ *
+ * With a baudrate each byte over the line costs 10 bits of time on the
+ * clock (8N1). When the modem has a fixed rate (AT+IPR) and the host
+ * side is at another rate, the modem does not understand a thing.
+ */
+
+#ifndef SIMX00EMULATOR_H_
+#define SIMX00EMULATOR_H_
+
+#include <Arduino.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+class SIMx00Emulator : public Stream
+{
+public:
+  SIMx00Emulator() :
+    sim900(false), latency(20), baudrate(0), modemBaudrate(0),
+    rssi(18), ber(0), cregStat(1), maxAccept(0),
+    httpBody("Hello world body"),
+    _lastReplyAt(0), _wireMicros(0), _dataExpected(0), _prompt(true), _quickSend(false)
+  {}
+
+  // Reply like SIM900 (no space after the ':' of some replies)
+  bool sim900;
+  // The time between the end of a command and the start of the reply
+  unsigned long latency;
+  // The rate of the host side of the line, 0 is infinitely fast
+  uint32_t baudrate;
+  // The rate of the modem (AT+IPR), 0 is autobauding
+  uint32_t modemBaudrate;
+  int rssi;
+  int ber;
+  int cregStat;
+  // In quick send mode, accept at most this much of an AT+CIPSEND (0 is all)
+  size_t maxAccept;
+  // The body of each HTTP GET
+  std::string httpBody;
+
+  // Everything the modem has received, raw
+  std::string txLog;
+  // Each command line that the modem has received
+  std::vector<std::string> commands;
+  // The data of the last HTTP POST
+  std::string posted;
+  // The data of all FTPPUT=2
+  std::string ftpData;
+  // The TCP data that waits to be read with AT+CIPRXGET=2, of openTCP
+  // and of the sockets (AT+CIPMUX=1)
+  std::string tcpRxData;
+  std::string socketRxData[6];
+
+  // Called for each command line. Return true if it has been answered.
+  std::function<bool(const std::string &cmd)> hook;
+
+  // Let the modem send \a text, \a delayMs after the normal latency.
+  // Replies come out in the order they were queued.
+  void reply(const std::string &text, unsigned long delayMs = 0)
+  {
+    unsigned long at = millis() + latency + delayMs;
+    if (at < _lastReplyAt) {
+      at = _lastReplyAt;
+    }
+    _lastReplyAt = at;
+    _output.push_back(Pending(at, text));
+  }
+  void ok(unsigned long delayMs = 0) { reply("\r\nOK\r\n", delayMs); }
+  void error() { reply("\r\nERROR\r\n"); }
+
+  // Data comes in from the network, for a socket or for openTCP (-1)
+  void receive(const std::string &data, int socket = -1)
+  {
+    if (socket < 0) {
+      tcpRxData += data;
+      reply("\r\n+CIPRXGET:" + space() + "1\r\n");
+    } else {
+      socketRxData[socket] += data;
+      reply("\r\n+CIPRXGET:" + space() + "1," + std::to_string(socket) + "\r\n");
+    }
+  }
+
+  // The modem expects \a size bytes of data, then calls \a done
+  void expectData(size_t size, std::function<void(const std::string &data)> done)
+  {
+    _dataExpected = size;
+    _dataDone = done;
+    _data.clear();
+    if (size == 0) {
+      done("");
+    }
+  }
+
+  int available()
+  {
+    int count = 0;
+    for (size_t i = 0; i < _output.size() && _output[i].at <= millis(); ++i) {
+      count += _output[i].text.size();
+    }
+    return count;
+  }
+
+  int peek()
+  {
+    if (_output.empty() || _output.front().at > millis()) {
+      delay(1);
+      return -1;
+    }
+    return (uint8_t)_output.front().text[0];
+  }
+
+  int read()
+  {
+    int c = peek();
+    if (c >= 0) {
+      wireTime();
+      _output.front().text.erase(0, 1);
+      if (_output.front().text.empty()) {
+        _output.pop_front();
+      }
+    }
+    return c;
+  }
+
+  size_t write(uint8_t c)
+  {
+    wireTime();
+    if (modemBaudrate != 0 && modemBaudrate != baudrate) {
+      // Garbage for the modem
+      return 1;
+    }
+    txLog += (char)c;
+    if (_dataExpected > 0) {
+      _data += (char)c;
+      if (--_dataExpected == 0) {
+        std::function<void(const std::string &)> done = _dataDone;
+        done(_data);
+      }
+      return 1;
+    }
+    if (c == '\r') {
+      std::string line = _line;
+      _line.clear();
+      if (!line.empty()) {
+        command(line);
+      }
+    } else if (c != '\n') {
+      _line += (char)c;
+    }
+    return 1;
+  }
+
+private:
+  struct Pending
+  {
+    Pending(unsigned long at, const std::string &text) : at(at), text(text) {}
+    unsigned long at;
+    std::string text;
+  };
+
+  // One byte over the line
+  void wireTime()
+  {
+    if (baudrate == 0) {
+      return;
+    }
+    _wireMicros += 10000000UL / baudrate;
+    if (_wireMicros >= 1000) {
+      delay(_wireMicros / 1000);
+      _wireMicros %= 1000;
+    }
+  }
+
+  static bool startsWith(const std::string &str, const char *prefix)
+  {
+    return str.compare(0, strlen(prefix), prefix) == 0;
+  }
+
+  // The number after the prefix, or after the first ',' following it
+  static long number(const std::string &cmd, size_t pos)
+  {
+    return pos < cmd.size() ? atol(cmd.c_str() + pos) : 0;
+  }
+  static long numberAfterComma(const std::string &cmd, size_t pos)
+  {
+    size_t comma = cmd.find(',', pos);
+    return comma != std::string::npos ? atol(cmd.c_str() + comma + 1) : 0;
+  }
+
+  // The space after the ':' that SIM900 leaves out
+  std::string space() const { return sim900 ? "" : " "; }
+
+  void command(const std::string &cmd)
+  {
+    commands.push_back(cmd);
+    if (hook && hook(cmd)) {
+      return;
+    }
+
+    if (cmd == "+++") {
+      ok();
+    } else if (cmd.find(';') != std::string::npos) {
+      // Concatenated commands
+      ok();
+    } else if (cmd == "AT" || cmd == "ATE0" || cmd == "AT+HTTPINIT" || cmd == "AT+HTTPTERM"
+        || cmd == "AT+CIICR"
+        || startsWith(cmd, "AT+CIURC") || startsWith(cmd, "AT+SAPBR=3") || startsWith(cmd, "AT+SAPBR=1")
+        || startsWith(cmd, "AT+HTTPPARA") || (startsWith(cmd, "AT+FTP") && !startsWith(cmd, "AT+FTPPUT="))
+        || startsWith(cmd, "AT+CSTT") || startsWith(cmd, "AT+CIPMODE") || startsWith(cmd, "AT+CIPMUX")
+        || startsWith(cmd, "AT+CGATT") || startsWith(cmd, "AT+CMGF") || startsWith(cmd, "AT+CLTS")
+        || startsWith(cmd, "AT+CREG=") || startsWith(cmd, "AT+CGREG=") || startsWith(cmd, "AT+CIPRXGET=1")
+        || startsWith(cmd, "AT+CIPRXGET=0") || startsWith(cmd, "AT+CIPCCFG=") || startsWith(cmd, "AT+CIPHEAD")) {
+      ok();
+    } else if (startsWith(cmd, "AT+IPR=")) {
+      // The OK still goes out at the old rate
+      ok();
+      modemBaudrate = number(cmd, 7);
+    } else if (startsWith(cmd, "AT+CLPORT=")) {
+      // Only the AT+CIPMUX=1 form, AT+CLPORT=<n>,"TCP",<port>
+      if (cmd[10] >= '0' && cmd[10] <= '9') {
+        ok();
+      } else {
+        error();
+      }
+    } else if (startsWith(cmd, "AT+CIPSPRT=")) {
+      _prompt = number(cmd, 11) != 0;
+      ok();
+    } else if (startsWith(cmd, "AT+CIPQSEND=")) {
+      _quickSend = number(cmd, 12) != 0;
+      ok();
+    } else if (cmd == "AT+IPR?") {
+      reply("\r\n+IPR: " + std::to_string(modemBaudrate) + "\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CSQ") {
+      reply("\r\n+CSQ: " + std::to_string(rssi) + "," + std::to_string(ber) + "\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CREG?") {
+      reply("\r\n+CREG:" + space() + "0," + std::to_string(cregStat) + "\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CGREG?") {
+      reply("\r\n+CGREG:" + space() + "0," + std::to_string(cregStat) + "\r\n\r\nOK\r\n");
+    } else if (cmd == "ATI") {
+      reply(sim900 ? "\r\nSIM900 R11.0\r\n\r\nOK\r\n" : "\r\nSIM800 R14.18\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+GMR") {
+      reply("\r\nRevision:1418B04SIM800L24\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+GSN") {
+      reply("\r\n861785005921311\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CCID") {
+      reply("\r\n89314404000012345678\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CIMI") {
+      reply("\r\n204080000000001\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CIFSR") {
+      reply("\r\n10.0.0.7\r\n");
+    } else if (cmd == "AT+SAPBR=2,1") {
+      reply("\r\n+SAPBR: 1,1,\"10.0.0.7\"\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CIPSHUT") {
+      reply("\r\nSHUT OK\r\n");
+    } else if (cmd == "AT+CIPCCFG?") {
+      reply("\r\n+CIPCCFG: 5,2,1024,1,0,1460,50\r\n\r\nOK\r\n");
+    } else if (cmd == "AT+CIPSEND?") {
+      reply("\r\n+CIPSEND: 1460\r\n\r\nOK\r\n");
+    } else if (startsWith(cmd, "AT+CIPSTART=")) {
+      ok();
+      if (cmd[12] >= '0' && cmd[12] <= '9') {
+        // AT+CIPMUX=1
+        reply(std::string("\r\n") + cmd[12] + ", CONNECT OK\r\n", 200);
+      } else {
+        reply("\r\nCONNECT OK\r\n", 200);
+      }
+    } else if (startsWith(cmd, "AT+CIPSEND=")) {
+      cipSend(cmd);
+    } else if (startsWith(cmd, "AT+CIPCLOSE=")) {
+      reply(std::string("\r\n") + cmd[12] + ", CLOSE OK\r\n");
+    } else if (cmd == "AT+CIPSTATUS") {
+      reply("\r\nOK\r\n\r\nSTATE: CONNECT OK\r\n");
+    } else if (startsWith(cmd, "AT+CIPRXGET=2,")) {
+      cipRxGet(cmd);
+    } else if (startsWith(cmd, "AT+HTTPDATA=")) {
+      reply("\r\nDOWNLOAD\r\n");
+      expectData(number(cmd, 12), [this](const std::string &data) {
+        posted = data;
+        ok();
+      });
+    } else if (startsWith(cmd, "AT+HTTPACTION=")) {
+      ok();
+      reply("\r\n+HTTPACTION:" + space() + cmd[14] + ",200," + std::to_string(httpBody.size()) + "\r\n", 1500);
+    } else if (cmd == "AT+HTTPREAD") {
+      reply("\r\n+HTTPREAD:" + space() + std::to_string(httpBody.size()) + "\r\n" + httpBody + "\r\nOK\r\n");
+    } else if (startsWith(cmd, "AT+HTTPREAD=")) {
+      size_t start = number(cmd, 12);
+      size_t size = numberAfterComma(cmd, 12);
+      std::string part = start < httpBody.size() ? httpBody.substr(start, size) : "";
+      reply("\r\n+HTTPREAD:" + space() + std::to_string(part.size()) + "\r\n" + part + "\r\nOK\r\n");
+    } else if (cmd == "AT+FTPPUT=1") {
+      ok();
+      reply("\r\n+FTPPUT:" + space() + "1,1,1360\r\n", 1000);
+    } else if (startsWith(cmd, "AT+FTPPUT=2,0")) {
+      ok();
+      reply("\r\n+FTPPUT:" + space() + "1,0\r\n", 200);
+    } else if (startsWith(cmd, "AT+FTPPUT=2,")) {
+      size_t size = number(cmd, 12);
+      reply("\r\n+FTPPUT:" + space() + "2," + std::to_string(size) + "\r\n");
+      expectData(size, [this](const std::string &data) {
+        ftpData += data;
+        ok();
+        reply("\r\n+FTPPUT:" + space() + "1,1,1360\r\n", 300);
+      });
+    } else {
+      error();
+    }
+  }
+
+  void cipRxGet(const std::string &cmd)
+  {
+    // AT+CIPRXGET=2,<reqlength> or with AT+CIPMUX=1 AT+CIPRXGET=2,<id>,<reqlength>
+    std::string *data = &tcpRxData;
+    std::string id;
+    size_t size;
+    if (cmd.find(',', 14) != std::string::npos) {
+      int socket = number(cmd, 14);
+      data = &socketRxData[socket % 6];
+      id = std::to_string(socket) + ",";
+      size = numberAfterComma(cmd, 14);
+    } else {
+      size = number(cmd, 14);
+    }
+    std::string part = data->substr(0, size);
+    data->erase(0, part.size());
+    reply("\r\n+CIPRXGET:" + space() + "2," + id + std::to_string(part.size()) + "," + std::to_string(data->size())
+        + "\r\n" + part + "\r\nOK\r\n");
+  }
+
+  void cipSend(const std::string &cmd)
+  {
+    // AT+CIPSEND=<length> or with AT+CIPMUX=1 AT+CIPSEND=<id>,<length>
+    int id = -1;
+    size_t size;
+    if (cmd.find(',') != std::string::npos) {
+      id = number(cmd, 11);
+      size = numberAfterComma(cmd, 11);
+    } else {
+      size = number(cmd, 11);
+    }
+    if (_prompt) {
+      reply("\r\n> ");
+    }
+    expectData(size, [this, id, size](const std::string &) {
+      if (id >= 0) {
+        reply(std::to_string(id) + ", SEND OK\r\n", 50);
+      } else if (_quickSend) {
+        size_t accepted = maxAccept != 0 && maxAccept < size ? maxAccept : size;
+        reply("\r\nDATA ACCEPT:" + std::to_string(accepted) + "\r\n", 5);
+      } else {
+        reply("\r\nSEND OK\r\n", 50);
+      }
+    });
+  }
+
+  std::deque<Pending> _output;
+  unsigned long _lastReplyAt;
+  unsigned long _wireMicros;
+  std::string _line;
+  size_t _dataExpected;
+  std::string _data;
+  std::function<void(const std::string &)> _dataDone;
+  bool _prompt;
+  bool _quickSend;
+};
+
+#endif /* SIMX00EMULATOR_H_ */
@@ -0,0 +1,547 @@
+/*
+ * Benchmark of the GPRSbee operations against a scripted SIM800.
+ *
+ * This runs on the host, not on the Arduino.  The library is built with
+ * the small Arduino core in host/ and talks to SIMx00Emulator on a
+ * virtual clock.  For each operation it prints the (virtual) time it took
+ * and the number of bytes sent to and received from the modem.
+ *
+ * Sodaq_GSM_Modem declares a few print functions that it never defines,
+ * the linker must drop the unused functions.
+ *
+ *   g++ -std=gnu++11 -O2 -ffunction-sections -Wl,--gc-sections -Ihost -I../../src \
+ *     bench_gprsbee.cpp ../../src/GPRSbee.cpp ../../src/Sodaq_GSM_Modem.cpp \
+ *     ../../src/GPRSbeeFields.cpp -o bench_gprsbee
+ *   ./bench_gprsbee
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SIMx00Emulator.h"
+#include "GPRSbee.h"
+
+static unsigned long virtualTime;
+
+unsigned long millis()
+{
+  return virtualTime;
+}
+
+void delay(unsigned long ms)
+{
+  virtualTime += ms;
+}
+
+static SIMx00Emulator modem;
+
+static void report(const char *name, bool ok, unsigned long start)
+{
+  printf("%-14s %-4s %7lu ms  tx=%lu rx=%lu\n", name, ok ? "ok" : "FAIL", millis() - start,
+      (unsigned long)gprsbee.getTxCount(), (unsigned long)gprsbee.getRxCount());
+}
+
+#define BENCH(name, expr) \
+  do { \
+    unsigned long start = millis(); \
+    gprsbee.resetTxRxCount(); \
+    bool ok = (expr); \
+    report(name, ok, start); \
+  } while (0)
+
+// The time from the start of a command to its OK, the delay and the
+// input flush before the command included
+static void benchRoundTrip()
+{
+  const int count = 100;
+  gprsbee.on();
+  unsigned long start = millis();
+  for (int i = 0; i < count; ++i) {
+    gprsbee.sendCommandWaitForOK("AT");
+  }
+  printf("%-14s %-4s %7lu ms\n", "AT round trip", "", (millis() - start) / count);
+  gprsbee.off();
+}
+
+// Send one segment over TCP, normal and in quick send mode. A partial
+// DATA ACCEPT must fail.
+static void benchQuickSend()
+{
+  static uint8_t data[1400];
+  for (size_t i = 0; i < sizeof(data); ++i) {
+    data[i] = 'A' + i % 26;
+  }
+
+  gprsbee.openTCP("apn", "example.com", 1883);
+  BENCH("TCP 1400", gprsbee.sendDataTCP(data, sizeof(data)));
+  gprsbee.closeTCP();
+
+  gprsbee.setTCPQuickSend(true, true);
+  gprsbee.openTCP("apn", "example.com", 1883);
+  BENCH("quick+prompt", gprsbee.sendDataTCP(data, sizeof(data)));
+  gprsbee.closeTCP();
+
+  gprsbee.setTCPQuickSend(true, false);
+  gprsbee.openTCP("apn", "example.com", 1883);
+  BENCH("quick", gprsbee.sendDataTCP(data, sizeof(data)));
+  modem.maxAccept = 100;
+  bool partial = gprsbee.sendDataTCP(data, sizeof(data));
+  modem.maxAccept = 0;
+  gprsbee.closeTCP();
+  gprsbee.setTCPQuickSend(false);
+  printf("%-14s %s\n", "partial accept", !partial ? "ok" : "FAIL");
+}
+
+// A GET at a site without coverage (+CSQ: 99,99) must give up early
+static void benchNoCoverage()
+{
+  char buffer[64];
+  gprsbee.setSignalQualitySkipTime(0);
+  modem.rssi = 99;
+  modem.ber = 99;
+  BENCH("no coverage", !gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer)));
+  modem.rssi = 18;
+  modem.ber = 0;
+  gprsbee.setSignalQualitySkipTime(GPRSBEE_CSQ_SKIP_TIME);
+}
+
+// Reading the identity of the modem and the SIM. The first time after a
+// reset it is probed, then it comes from RAM or from the store.
+static GPRSbeeIdentity storedIdentity;
+static bool haveStoredIdentity;
+
+static bool loadIdentity(GPRSbeeIdentity &identity)
+{
+  if (haveStoredIdentity) {
+    identity = storedIdentity;
+  }
+  return haveStoredIdentity;
+}
+
+static void saveIdentity(const GPRSbeeIdentity &identity)
+{
+  storedIdentity = identity;
+  haveStoredIdentity = true;
+}
+
+static bool readIdentity()
+{
+  char buffer[32];
+  return gprsbee.getIMEI(buffer, sizeof(buffer)) && gprsbee.getCCID(buffer, sizeof(buffer))
+      && gprsbee.getCIMI(buffer, sizeof(buffer)) && gprsbee.getFirmware(buffer, sizeof(buffer));
+}
+
+static void benchIdentity()
+{
+  gprsbee.setIdentityStore(loadIdentity, saveIdentity);
+  gprsbee.on();
+  BENCH("identity", readIdentity());
+  BENCH("identity RAM", readIdentity());
+  gprsbee.off();
+  gprsbee.on();
+  BENCH("identity store", readIdentity());
+  gprsbee.off();
+  gprsbee.setIdentityStore(NULL, NULL);
+}
+
+// The number of command lines with more than one command (AT+A;+B)
+static size_t batches(size_t from)
+{
+  size_t count = 0;
+  for (size_t i = from; i < modem.commands.size(); ++i) {
+    if (modem.commands[i].find(';') != std::string::npos) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// A batch that times out once must not make the library give up on
+// batches, one that gets an ERROR must
+static void checkBatch()
+{
+  char buffer[64];
+  bool timeout = true;
+  modem.hook = [&timeout](const std::string &cmd) {
+    // No answer at all
+    return timeout && cmd.find(';') != std::string::npos;
+  };
+  bool ok = gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer));
+  timeout = false;
+  size_t from = modem.commands.size();
+  ok = ok && gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer)) && batches(from) == 1;
+  printf("%-14s %s\n", "batch timeout", ok ? "ok" : "FAIL");
+
+  modem.hook = [](const std::string &cmd) {
+    if (cmd.find(';') != std::string::npos) {
+      modem.error();
+      return true;
+    }
+    return false;
+  };
+  ok = gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer));
+  from = modem.commands.size();
+  ok = ok && gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer)) && batches(from) == 0;
+  printf("%-14s %s\n", "batch ERROR", ok ? "ok" : "FAIL");
+  modem.hook = NULL;
+}
+
+// The host side of the line follows the library
+static void changeBaudrate(uint32_t rate)
+{
+  modem.baudrate = rate;
+}
+
+// Send one FTP chunk, GET and POST as much with HTTP, after the library
+// has switched to a baud rate
+static void benchBaudrate()
+{
+  static const uint32_t rates[] = { 9600, 19200, 115200, 460800 };
+  static uint8_t data[1360];
+  static char reply[sizeof(data) + 1];
+  memset(data, 'x', sizeof(data));
+  std::string body = modem.httpBody;
+  modem.httpBody.assign(sizeof(data), 'y');
+
+  modem.baudrate = gprsbee.getBaudrate();
+  gprsbee.enableBaudrateChange(changeBaudrate);
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+    char name[20];
+    snprintf(name, sizeof(name), "FTP %lu", (unsigned long)rates[i]);
+    gprsbee.setBaudrate(rates[i]);
+    gprsbee.openFTP("apn", "ftp.example.com", "user", "secret");
+    gprsbee.openFTPfile("data.txt", "/");
+    BENCH(name, gprsbee.sendFTPdata(data, sizeof(data)) && gprsbee.getBaudrate() == rates[i]);
+    gprsbee.closeFTPfile();
+    gprsbee.closeFTP();
+    gprsbee.off();
+
+    gprsbee.openHTTPSession("apn");
+    snprintf(name, sizeof(name), "GET %lu", (unsigned long)rates[i]);
+    BENCH(name, gprsbee.doHTTPSessionGET("http://example.com/get", reply, sizeof(reply))
+        && modem.httpBody == reply && gprsbee.getBaudrate() == rates[i]);
+    snprintf(name, sizeof(name), "POST %lu", (unsigned long)rates[i]);
+    BENCH(name, gprsbee.doHTTPSessionPOST("http://example.com/post", (const char *)data, sizeof(data))
+        && modem.posted.size() == sizeof(data));
+    gprsbee.closeHTTPSession();
+  }
+  modem.httpBody = body;
+
+  // A lost reply to AT+IPR? must not keep the rate from being tried later
+  char buffer[64];
+  bool lost = true;
+  modem.hook = [&lost](const std::string &cmd) {
+    if (lost && cmd == "AT+IPR?") {
+      lost = false;
+      return true;
+    }
+    return false;
+  };
+  gprsbee.setBaudrate(115200);
+  bool ok = gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && gprsbee.getBaudrate() == 460800;
+  ok = ok && gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && gprsbee.getBaudrate() == 115200;
+  modem.hook = NULL;
+  printf("%-14s %s\n", "lost +IPR:", ok ? "ok" : "FAIL");
+
+  // A modem with a fixed 57600 that takes AT+IPR=460800 but does not
+  // answer at that rate must be set back to 57600
+  gprsbee.setBaudrate(57600);
+  ok = gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && modem.modemBaudrate == 57600;
+  modem.hook = [](const std::string &cmd) {
+    return cmd == "AT" && modem.modemBaudrate == 460800;
+  };
+  gprsbee.setBaudrate(460800);
+  ok = ok && gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && gprsbee.getBaudrate() == 57600 && modem.modemBaudrate == 57600;
+  modem.hook = NULL;
+  gprsbee.setBaudrate(115200);
+  ok = ok && gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer));
+  printf("%-14s %s\n", "back to 57600", ok ? "ok" : "FAIL");
+}
+
+// Another modem, it has 57600 saved. Without a probe on() gives up.
+static void benchProbe()
+{
+  static const uint32_t rates[] = { 19200, 115200, 57600, 9600 };
+  char buffer[64];
+
+  gprsbee.setBaudrate(0);
+  modem.modemBaudrate = 57600;
+  BENCH("wrong rate", !gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer)));
+  gprsbee.setBaudrateProbe(rates, sizeof(rates) / sizeof(rates[0]));
+  BENCH("probe", gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && gprsbee.getBaudrate() == 57600);
+  BENCH("probe again", gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer)));
+  gprsbee.setBaudrateProbe(NULL, 0);
+}
+
+// TCP data with AT+CIPRXGET must arrive complete, without asking for
+// more than fits in the receive buffer. A reply with more data than
+// asked for must be dropped as a whole.
+static void checkTCPReceive()
+{
+  std::string data;
+  for (int i = 0; i < 200; ++i) {
+    data += 'a' + i % 26;
+  }
+  uint8_t buffer[200];
+  gprsbee.setTCPRxGet(true);
+  bool ok = gprsbee.openTCP("apn", "example.com", 1883);
+  size_t from = modem.commands.size();
+  modem.receive(data);
+  ok = ok && gprsbee.receiveDataTCP(buffer, sizeof(buffer)) && std::string((char *)buffer, sizeof(buffer)) == data;
+  for (size_t i = from; i < modem.commands.size(); ++i) {
+    ok = ok && atoi(modem.commands[i].c_str() + 14) <= GPRSBEE_TCP_RX_BUFFER_SIZE;
+  }
+
+  bool tooMuch = true;
+  modem.hook = [&tooMuch](const std::string &cmd) {
+    if (tooMuch && cmd.compare(0, 14, "AT+CIPRXGET=2,") == 0) {
+      tooMuch = false;
+      modem.reply("\r\n+CIPRXGET: 2,600,0\r\n" + std::string(600, 'x') + "\r\nOK\r\n");
+      return true;
+    }
+    return false;
+  };
+  modem.receive("again");
+  ok = ok && !gprsbee.receiveDataTCP(buffer, 5, 500);
+  modem.hook = NULL;
+  ok = ok && gprsbee.receiveDataTCP(buffer, 5) && memcmp(buffer, "again", 5) == 0;
+  gprsbee.closeTCP();
+  gprsbee.setTCPRxGet(false);
+  printf("%-14s %s\n", "TCP receive", ok ? "ok" : "FAIL");
+}
+
+// A POST with a producer that stops early must fail, without leaving the
+// modem waiting for the rest of the data
+static size_t producerPos;
+static size_t shortProducer(uint8_t *buffer, size_t size)
+{
+  if (producerPos >= 100) {
+    return 0;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    buffer[i] = '0' + producerPos++ % 10;
+  }
+  return size;
+}
+
+// Data for two sockets, a whole TCP segment for one of them, must arrive
+// complete and in order
+static void checkSockets()
+{
+  std::string segment;
+  for (int i = 0; i < 1460; ++i) {
+    segment += 'A' + i % 26;
+  }
+  gprsbee.setApn("apn");
+  int s0 = gprsbee.createSocket(TCP);
+  int s1 = gprsbee.createSocket(TCP, 4000);
+  bool ok = s0 >= 0 && s1 >= 0 && gprsbee.connectSocket(s0, "example.com", 1883)
+      && gprsbee.connectSocket(s1, "example.com", 8000);
+  modem.receive(segment, s0);
+  modem.receive("hello", s1);
+  delay(100);
+
+  uint8_t buffer[512];
+  std::string got0;
+  std::string got1;
+  for (int i = 0; i < 10; ++i) {
+    size_t n = gprsbee.socketReceive(s0, buffer, sizeof(buffer));
+    got0.append((char *)buffer, n);
+    n = gprsbee.socketReceive(s1, buffer, sizeof(buffer));
+    got1.append((char *)buffer, n);
+  }
+  ok = ok && got0 == segment && got1 == "hello";
+
+  // A reply with more data than asked for must be dropped as a whole
+  bool tooMuch = true;
+  modem.hook = [&tooMuch](const std::string &cmd) {
+    if (tooMuch && cmd.compare(0, 14, "AT+CIPRXGET=2,") == 0) {
+      tooMuch = false;
+      modem.reply("\r\n+CIPRXGET: 2,0,600,0\r\n" + std::string(600, 'x') + "\r\nOK\r\n");
+      return true;
+    }
+    return false;
+  };
+  modem.receive("again", s0);
+  delay(100);
+  size_t n = gprsbee.socketReceive(s0, buffer, sizeof(buffer));
+  modem.hook = NULL;
+  ok = ok && n == 0;
+  got0.clear();
+  for (int i = 0; i < 3; ++i) {
+    n = gprsbee.socketReceive(s0, buffer, sizeof(buffer));
+    got0.append((char *)buffer, n);
+  }
+  ok = ok && got0 == "again";
+
+  // The network drops the context, the sockets are gone
+  ok = ok && gprsbee.isSocketConnected(s0);
+  modem.reply("\r\n+PDP: DEACT\r\n");
+  delay(100);
+  ok = ok && !gprsbee.isSocketConnected(s0) && !gprsbee.isSocketConnected(s1);
+  gprsbee.closeSocket(s0);
+  gprsbee.closeSocket(s1);
+  gprsbee.off();
+  printf("%-14s %s\n", "sockets", ok ? "ok" : "FAIL");
+}
+
+static void checkShortProducer()
+{
+  char buffer[64];
+  producerPos = 0;
+  gprsbee.openHTTPSession("apn");
+  bool failed = !gprsbee.doHTTPSessionPOST("http://example.com/post", shortProducer, 250);
+  // What the modem took as POST data must not contain the next command
+  failed = failed && modem.posted.size() == 250 && modem.posted.find("AT") == std::string::npos;
+  bool next = gprsbee.doHTTPSessionGET("http://example.com/get", buffer, sizeof(buffer))
+      && modem.httpBody == buffer;
+  gprsbee.closeHTTPSession();
+  printf("%-14s %s\n", "short producer", failed && next ? "ok" : "FAIL");
+}
+
+// A session GET after the linger time has passed must not close the
+// session halfway, not even when it takes longer than the linger time
+// itself. Here the bearer drops and the GET is done again. Only a poll()
+// of the user closes the session.
+static void checkSessionLinger()
+{
+  char buffer[64];
+  bool dropped = false;
+  modem.hook = [&dropped](const std::string &cmd) {
+    if (dropped && cmd.compare(0, 14, "AT+HTTPACTION=") == 0) {
+      modem.ok();
+      modem.reply("\r\n+HTTPACTION: 0,601,0\r\n", 500);
+      return true;
+    }
+    if (dropped && cmd == "AT+SAPBR=2,1") {
+      dropped = false;
+      modem.reply("\r\n+SAPBR: 1,3,\"0.0.0.0\"\r\n\r\nOK\r\n");
+      return true;
+    }
+    return false;
+  };
+  gprsbee.setHTTPSessionLinger(1000);
+  bool ok = gprsbee.openHTTPSession("apn");
+  dropped = true;
+  delay(2000);
+  ok = ok && gprsbee.doHTTPSessionGET("http://example.com/get", buffer, sizeof(buffer))
+      && modem.httpBody == buffer && gprsbee.isHTTPSessionOpen();
+  modem.hook = NULL;
+  delay(2000);
+  gprsbee.poll();
+  ok = ok && !gprsbee.isHTTPSessionOpen();
+  gprsbee.setHTTPSessionLinger(0);
+  printf("%-14s %s\n", "session linger", ok ? "ok" : "FAIL");
+}
+
+// A reply of more than 64K, read in chunks
+static std::string bigRead;
+static void bigReadCallback(const uint8_t *data, size_t len)
+{
+  bigRead.append((const char *)data, len);
+}
+
+static void checkBigRead()
+{
+  std::string body = modem.httpBody;
+  modem.httpBody.clear();
+  for (int i = 0; i < 70000; ++i) {
+    modem.httpBody += 'a' + i % 26;
+  }
+  bigRead.clear();
+  bool ok = gprsbee.openHTTPSession("apn") && gprsbee.doHTTPPOSTmiddle("http://example.com/post", "x", 1)
+      && gprsbee.doHTTPREAD(bigReadCallback, 1024) && bigRead == modem.httpBody
+      && modem.commands.back() == "AT+HTTPREAD=69632,368";
+  gprsbee.closeHTTPSession();
+  modem.httpBody = body;
+  printf("%-14s %s\n", "read 70000", ok ? "ok" : "FAIL");
+}
+
+// A failed attach must not be charged at the attach current for as long
+// as the modem stays on, and 5 hours in one state must not overflow
+static void checkEnergy()
+{
+  gprsbee.setEnergyCurrent(EnergyAttaching, 500);
+  gprsbee.setEnergyCurrent(EnergyIdle, 300);
+  gprsbee.setApn("apn");
+  modem.hook = [](const std::string &cmd) {
+    if (cmd == "AT+CIICR") {
+      modem.error();
+      return true;
+    }
+    return false;
+  };
+  bool ok = gprsbee.createSocket(TCP) < 0;
+  modem.hook = NULL;
+  uint32_t attaching = gprsbee.getStateTime(EnergyAttaching);
+  uint32_t charge = gprsbee.getTotalCharge();
+  delay(5UL * 3600 * 1000);
+  ok = ok && gprsbee.getStateTime(EnergyAttaching) == attaching
+      && gprsbee.getTotalCharge() - charge == 1500000;
+  gprsbee.off();
+  printf("%-14s %s\n", "energy", ok ? "ok" : "FAIL");
+}
+
+// SIM900 leaves out the space after the ':' of most replies and URCs
+static void checkSIM900()
+{
+  char buffer[64];
+  modem.sim900 = true;
+  printf("SIM900, no space after the ':'\n");
+  bool ok = gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && modem.httpBody == buffer;
+  ok = ok && gprsbee.openTCP("apn", "example.com", 1883) && gprsbee.isTCPConnected();
+  gprsbee.closeTCP();
+  printf("%-14s %s\n", "HTTP and TCP", ok ? "ok" : "FAIL");
+  checkSockets();
+  checkTCPReceive();
+  modem.sim900 = false;
+}
+
+int main()
+{
+  char buffer[64];
+  const char *postData = "temperature=21.5&humidity=40";
+  static uint8_t ftpData[3000];
+  for (size_t i = 0; i < sizeof(ftpData); ++i) {
+    ftpData[i] = 'a' + i % 26;
+  }
+
+  gprsbee.initAutonomoSIM800(modem, -1, -1, -1);
+
+  BENCH("doHTTPGET", gprsbee.doHTTPGET("apn", "http://example.com/get", buffer, sizeof(buffer))
+      && modem.httpBody == buffer);
+  BENCH("doHTTPPOST", gprsbee.doHTTPPOST("apn", "http://example.com/post", postData, strlen(postData))
+      && modem.posted == postData);
+  BENCH("openTCP", gprsbee.openTCP("apn", "example.com", 1883));
+  BENCH("sendDataTCP", gprsbee.sendDataTCP((uint8_t *)"0123456789", 10));
+  gprsbee.closeTCP();
+  BENCH("openFTP", gprsbee.openFTP("apn", "ftp.example.com", "user", "secret")
+      && gprsbee.openFTPfile("data.txt", "/"));
+  BENCH("sendFTPdata", gprsbee.sendFTPdata(ftpData, sizeof(ftpData))
+      && modem.ftpData.size() == sizeof(ftpData));
+  gprsbee.closeFTPfile();
+  gprsbee.closeFTP();
+
+  benchRoundTrip();
+  benchQuickSend();
+  benchNoCoverage();
+  benchIdentity();
+  checkShortProducer();
+  checkBigRead();
+  checkSessionLinger();
+  checkSockets();
+  checkTCPReceive();
+  checkBatch();
+  checkEnergy();
+  checkSIM900();
+  benchBaudrate();
+  benchProbe();
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * The part of the Arduino core that GPRSbee uses, for a host build.
+ *
+ * millis() and delay() are not defined here. The program that links the
+ * library defines them, normally as a virtual clock.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "avr/pgmspace.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+// The modem is always on
+inline int digitalRead(int) { return HIGH; }
+
+inline char *itoa(int v, char *buf, int radix) { sprintf(buf, radix == 16 ? "%x" : "%d", v); return buf; }
+inline char *utoa(unsigned v, char *buf, int radix) { sprintf(buf, radix == 16 ? "%x" : "%u", v); return buf; }
+inline char *ltoa(long v, char *buf, int radix) { sprintf(buf, radix == 16 ? "%lx" : "%ld", v); return buf; }
+inline char *ultoa(unsigned long v, char *buf, int radix) { sprintf(buf, radix == 16 ? "%lx" : "%lu", v); return buf; }
+// avr-libc has div(int, int), a long argument must not be ambiguous
+inline div_t div(long num, int denom) { return div((int)num, denom); }
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+
+class String
+{
+public:
+  String(const char *str = "") : _str(str) {}
+  String(const __FlashStringHelper *str) : _str(reinterpret_cast<const char *>(str)) {}
+  void reserve(size_t size) { _str.reserve(size); }
+  const char *c_str() const { return _str.c_str(); }
+  unsigned length() const { return _str.size(); }
+  String & operator+=(const char *str) { _str += str; return *this; }
+  String & operator+=(char c) { _str += c; return *this; }
+  String & operator+=(int v) { _str += std::to_string(v); return *this; }
+  String & operator+=(unsigned v) { _str += std::to_string(v); return *this; }
+private:
+  std::string _str;
+};
+
+class Print;
+
+class Printable
+{
+public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size)
+  {
+    size_t n = 0;
+    while (size--) {
+      n += write(*buf++);
+    }
+    return n;
+  }
+  size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+  size_t write(const char *buf, size_t size) { return write((const uint8_t *)buf, size); }
+  virtual int availableForWrite() { return 0; }
+
+  size_t print(const __FlashStringHelper *str) { return write(reinterpret_cast<const char *>(str)); }
+  size_t print(const String &str) { return write(str.c_str()); }
+  size_t print(const char str[]) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char v, int base = DEC) { return printNumber(v, base); }
+  size_t print(int v, int base = DEC) { return printSigned(v, base); }
+  size_t print(unsigned int v, int base = DEC) { return printNumber(v, base); }
+  size_t print(long v, int base = DEC) { return printSigned(v, base); }
+  size_t print(unsigned long v, int base = DEC) { return printNumber(v, base); }
+  size_t print(double v, int digits = 2)
+  {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    return write(buf);
+  }
+  size_t print(const Printable &p) { return p.printTo(*this); }
+
+  size_t println() { return write("\r\n"); }
+  template<typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template<typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+
+private:
+  size_t printNumber(unsigned long v, int base)
+  {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%lu", v);
+    return write(buf);
+  }
+  size_t printSigned(long v, int base)
+  {
+    if (base != DEC) {
+      return printNumber((unsigned long)v, base);
+    }
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", v);
+    return write(buf);
+  }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+#endif /* ARDUINO_H */
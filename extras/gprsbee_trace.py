@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+#
+# Show the trace of GPRSbee (see GPRSbeeClass::dumpTrace) with the
+# latency of each AT command.
+#
+# The input has one record per line:
+#   T 10230 AT+CSQ
+#   R 10262 +CSQ: 18,0
+#   R 10263 OK
+# T is a command sent to the modem, R a line received from the modem, the
+# number is the millis() timestamp.
+#
+# Usage: gprsbee_trace.py [file]      (reads stdin without a file)
+
+import re
+import sys
+
+# Replies that end a command
+FINAL_REPLIES = re.compile(r'^(OK|ERROR|\+CME ERROR.*|\+CMS ERROR.*|SHUT OK|SEND OK|SEND FAIL'
+                           r'|DATA ACCEPT:.*|CONNECT.*|NO CARRIER|DOWNLOAD|> ?)$')
+
+# Replies that come some time after the OK of a command
+ASYNC_REPLIES = {
+    'AT+HTTPACTION': '+HTTPACTION:',
+    'AT+CIPSTART': 'CONNECT',
+    'AT+FTPPUT': '+FTPPUT:',
+}
+
+
+def command_name(line):
+    """The command without its parameters, e.g. AT+HTTPPARA"""
+    m = re.match(r'^(AT[+#*]?[A-Z]*|AT)', line)
+    return m.group(1) if m else line
+
+
+def parse(lines):
+    for line in lines:
+        line = line.rstrip('\r\n')
+        m = re.match(r'^([TR]) (\d+) ?(.*)$', line)
+        if m:
+            yield m.group(1), int(m.group(2)), m.group(3)
+
+
+def main():
+    f = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+
+    stats = {}
+    pending = None              # (name, ts) of the command waiting for its final reply
+    waiting = None              # (name, ts, prefix) of the command waiting for an async reply
+    prev_ts = None
+
+    for kind, ts, text in parse(f):
+        delta = ts - prev_ts if prev_ts is not None else 0
+        prev_ts = ts
+        note = ''
+        if kind == 'T':
+            name = command_name(text)
+            pending = (name, ts)
+            if name in ASYNC_REPLIES:
+                waiting = (name, ts, ASYNC_REPLIES[name])
+            print('%10d %+7d  >> %s' % (ts, delta, text))
+            continue
+
+        if pending and FINAL_REPLIES.match(text):
+            name, start = pending
+            latency = ts - start
+            stats.setdefault(name, []).append(latency)
+            note = '   [%s %d ms]' % (name, latency)
+            pending = None
+        elif waiting and text.startswith(waiting[2]):
+            name, start, _ = waiting
+            latency = ts - start
+            stats.setdefault(name + ' ' + waiting[2], []).append(latency)
+            note = '   [%s until %s %d ms]' % (name, waiting[2], latency)
+            waiting = None
+        print('%10d %+7d  << %s%s' % (ts, delta, text, note))
+
+    if stats:
+        print()
+        print('%-32s %5s %8s %8s %8s %9s' % ('command', 'count', 'min', 'avg', 'max', 'total'))
+        for name, values in sorted(stats.items(), key=lambda kv: -sum(kv[1])):
+            print('%-32s %5d %8d %8d %8d %9d' % (name, len(values), min(values),
+                                                 sum(values) // len(values), max(values),
+                                                 sum(values)))
+
+
+if __name__ == '__main__':
+    main()
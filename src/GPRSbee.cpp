@@ -29,13 +29,30 @@
 #include <stdlib.h>
 
 #include "GPRSbee.h"
+#include "GPRSbeeFields.h"
 
-#if ENABLE_GPRSBEE_DIAG
-#define diagPrint(...) { if (_diagStream) _diagStream->print(__VA_ARGS__); }
-#define diagPrintLn(...) { if (_diagStream) _diagStream->println(__VA_ARGS__); }
+// diagError(GPRSBEE_DIAG_TCP, ...) etc. compile to nothing when the level or
+// the category is disabled (see GPRSBEE_DIAG_LEVEL)
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_ERROR
+#define diagError(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define diagErrorLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
 #else
-#define diagPrint(...)
-#define diagPrintLn(...)
+#define diagError(...)
+#define diagErrorLn(...)
+#endif
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_INFO
+#define diagInfo(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define diagInfoLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
+#else
+#define diagInfo(...)
+#define diagInfoLn(...)
+#endif
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_DEBUG
+#define diagDebug(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define diagDebugLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
+#else
+#define diagDebug(...)
+#define diagDebugLn(...)
 #endif
 
 
@@ -92,6 +109,12 @@ void GPRSbeeClass::initProlog(Stream &stream, size_t bufferSize)
   _diagStream = 0;
 
   _ftpMaxLength = 0;
+  _batchMode = false;
+  _batchOK = false;
+  _batchUnsupported = false;
+  _batchRejected = false;
+  _batchPass = 0;
+  _batchCount = 0;
   _transMode = false;
 
   _echoOff = false;
@@ -99,13 +122,92 @@ void GPRSbeeClass::initProlog(Stream &stream, size_t bufferSize)
   _changedSkipCGATT = false;
 
   _productId = prodid_unknown;
+  _identityValid = false;
+  _identityLoad = NULL;
+  _identitySave = NULL;
 
   _timeToOpenTCP = 0;
   _timeToCloseTCP = 0;
+  _timeToDoHTTP = 0;
+  _timeToOpenFTP = 0;
+  _timeToCloseFTP = 0;
+
+  _txCount = 0;
+  _rxCount = 0;
+
+  _lineLen = 0;
+  _lineSeenCR = false;
+  _commandQueue = NULL;
+  _currentCommand = NULL;
+  _inWaitForCommand = false;
+
+  _bearerOpen = false;
+  _localIP = NO_IP_ADDRESS;
+  _httpInitDone = false;
+  _httpSessionOpen = false;
+  _httpSessionLinger = 0;
+  _httpSessionLastUse = 0;
+
+  _uploadQueue = NULL;
+  _uploadQueueSize = 0;
+  _uploadCount = 0;
+
+  _httpDataLen = 0;
+  _httpDataLenKnown = false;
+
+  resetSockets();
+
+  _baudrate = 0;
+  _targetBaudrate = 0;
+  _failedBaudrate = 0;
+  _probeRates = NULL;
+  _probeRatesCount = 0;
+
+  _tcpRxGet = false;
+  _tcpDataPending = false;
+  _tcpRxBuffer = NULL;
+
+  _tcpQuickSend = false;
+  _tcpSendPrompt = true;
+  _tcpMaxSend = GPRSBEE_MAX_SEND_SIZE;
+
+  _transWaitTm = 1;
+  _transSendSz = GPRSBEE_MAX_SEND_SIZE;
+  _escapeGuardTime = 1000;
+  _transLastData = 0;
+
+  _traceBuffer = NULL;
+  _traceSize = 0;
+  _traceTail = 0;
+  _traceUsed = 0;
+  _traceOpen = false;
+  _traceRecord = 0;
+  _traceCallback = NULL;
+
+  _urcCallback = NULL;
+  _tcpClosed = false;
+  _cregStat = 0;
+  _cgregStat = 0;
+  _registrationURC = false;
+  _callReady = false;
+
+  _rssiCount = 0;
+  _goodSignalSeen = false;
+  _goodSignalTs = 0;
+  _signalSkipTime = GPRSBEE_CSQ_SKIP_TIME;
+
+  _newSMSIndex = -1;
+  _networkTime = 0;
+  _networkTimeTs = 0;
 }
 
 bool GPRSbeeClass::isAlive()
 {
+  if (_probeRatesCount != 0 && _baudRateChangeCallbackPtr != NULL) {
+    // Just as long as the three tries below can take
+    return probeBaudrate(3 * 4000);
+  }
+
   // Send "AT" and wait for "OK"
   // Try it at least 3 times before deciding it failed
   for (int i = 0; i < 3; i++) {
@@ -117,6 +219,132 @@ bool GPRSbeeClass::isAlive()
   return false;
 }
 
+/*
+ * \brief Find the baud rate that the modem answers at
+ *
+ * Each rate gets one "AT" with a short timeout, starting with the rate
+ * that worked last time, until the modem answers or the time is up.
+ * This way a modem that is still booting, or one that has another
+ * AT+IPR saved, costs a few seconds instead of the full timeouts of
+ * isAlive() for each try of on().
+ */
+bool GPRSbeeClass::probeBaudrate(uint16_t timeout)
+{
+  uint32_t start = millis();
+  uint32_t lastRate = getBaudrate();
+  uint32_t streamRate = lastRate;
+
+  do {
+    // i == -1 is the rate that worked last time
+    for (int i = -1; i < _probeRatesCount; i++) {
+      uint32_t rate = i < 0 ? lastRate : _probeRates[i];
+      if (i >= 0 && rate == lastRate) {
+        continue;
+      }
+      if (rate != streamRate) {
+        _baudRateChangeCallbackPtr(rate);
+        streamRate = rate;
+      }
+      flushInput();
+      sendCommand_P(PSTR("AT"));
+      if (waitForOK(GPRSBEE_PROBE_MS)) {
+        if (rate != lastRate) {
+          diagInfo(GPRSBEE_DIAG_POWER, F("Modem found at "));
+          diagInfoLn(GPRSBEE_DIAG_POWER, rate);
+        }
+        _baudrate = rate;
+        return true;
+      }
+    }
+  } while ((millis() - start) < timeout);
+
+  // Leave the stream as it was
+  if (streamRate != lastRate) {
+    _baudRateChangeCallbackPtr(lastRate);
+  }
+  return false;
+}
+
+/*
+ * \brief Send "AT" a few times, with a short timeout, right after a change
+ * of the baud rate
+ */
+bool GPRSbeeClass::verifyLink()
+{
+  for (uint8_t i = 0; i < 3; i++) {
+    flushInput();
+    sendCommand_P(PSTR("AT"));
+    if (waitForOK(500)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * \brief Switch the modem and the modem stream to another baud rate
+ *
+ * The modem answers AT+IPR with OK at the old rate and then switches.
+ * After the callback has re-opened the stream, "AT" must work at the new
+ * rate. If it does not, for example because the UART cannot keep up,
+ * we go back to the old rate, or to autobauding if the modem was doing
+ * that.
+ *
+ * The modem stream stays at the new rate when the modem is switched off,
+ * because SIMx00 can save AT+IPR.
+ *
+ * \return false if we lost the modem, staying at the old rate is OK
+ */
+bool GPRSbeeClass::changeBaudrate(uint32_t rate)
+{
+  uint32_t oldRate = getBaudrate();
+  int32_t oldIPR;
+
+  if (_baudRateChangeCallbackPtr == NULL) {
+    return true;
+  }
+  // +IPR: 0 means autobauding. If we can't ask, try again next time.
+  // Not getIntValue_P(), an int of AVR can't hold 57600 or 115200.
+  sendCommand_P(PSTR("AT+IPR?"));
+  if (!waitForMessage_P(PSTR("+IPR:"), millis() + 4000)) {
+    return true;
+  }
+  GPRSbeeFields fields(_inputBuffer);
+  if (!fields.nextInt(&oldIPR) || !waitForOK()) {
+    return true;
+  }
+  sendCommandArgs_P(PSTR("AT+IPR="), rate);
+  if (!waitForOK()) {
+    // The modem does not support this rate
+    _failedBaudrate = rate;
+    return true;
+  }
+
+  _baudRateChangeCallbackPtr(rate);
+  if (verifyLink()) {
+    _baudrate = rate;
+    return true;
+  }
+
+  diagErrorLn(GPRSBEE_DIAG_POWER, F("No reply at the new baud rate, going back"));
+  _failedBaudrate = rate;
+  // The modem is probably at the new rate, maybe it hears us
+  sendCommandArgs_P(PSTR("AT+IPR="), (long)oldIPR);
+  waitForOK(500);
+  _baudRateChangeCallbackPtr(oldRate);
+  _baudrate = oldRate;
+  if (verifyLink()) {
+    return true;
+  }
+  // A power cycle brings it back, unless it saved the new rate
+  off();
+  if (!on()) {
+    return false;
+  }
+  switchEchoOff();
+  return true;
+}
+
 void GPRSbeeClass::switchEchoOff()
 {
   if (!_echoOff) {
@@ -135,9 +363,33 @@ void GPRSbeeClass::switchEchoOff()
 void GPRSbeeClass::flushInput()
 {
   int c;
-  while ((c = _modemStream->read()) >= 0) {
-    diagPrint((char)c);
+  while ((c = modemRead()) >= 0) {
+  }
+  _lineLen = 0;
+  _lineSeenCR = false;
+}
+
+/*
+ * \brief Discard input until SIM900 has been quiet for a while
+ *
+ * \param idle   the number of ms without input that we consider "idle"
+ * \param maxWait the maximum number of ms to wait for that
+ */
+void GPRSbeeClass::waitForLineIdle(uint16_t idle, uint16_t maxWait)
+{
+  uint32_t ts_max = millis() + maxWait;
+  uint32_t ts_idle = millis() + idle;
+  while (!isTimedOut(ts_idle) && !isTimedOut(ts_max)) {
+    wdt_reset();
+    uint32_t rxCount = _rxCount;
+    // Complete lines still go to the URC handlers
+    pollLine();
+    if (_rxCount != rxCount) {
+      ts_idle = millis() + idle;
+    }
   }
+  _lineLen = 0;
+  _lineSeenCR = false;
 }
 
 /*
@@ -149,52 +401,109 @@ int GPRSbeeClass::readLine(uint32_t ts_max)
     return -1;
   }
 
-  uint32_t ts_waitLF = 0;
-  bool seenCR = false;
-  int c;
-  size_t bufcnt;
-
-  //diagPrintLn(F("readLine"));
-  bufcnt = 0;
+  //diagDebugLn(GPRSBEE_DIAG_AT, F("readLine"));
   while (!isTimedOut(ts_max)) {
     wdt_reset();
-    if (seenCR) {
+    int len = pollLine();
+    if (len >= 0) {
+      //diagDebug(GPRSBEE_DIAG_AT, F(" ")); diagDebugLn(GPRSBEE_DIAG_AT, _inputBuffer);
+      return len;
+    }
+    if (len == -2) {
+      diagInfoLn(GPRSBEE_DIAG_AT, F("readLine aborted"));
+      return -1;
+    }
+  }
+
+  // Discard the partial line
+  _lineLen = 0;
+  _lineSeenCR = false;
+  diagInfoLn(GPRSBEE_DIAG_AT, F("readLine timed out"));
+  return -1;            // This indicates: timed out
+}
+
+/*
+ * \brief Collect the input from SIM900 that is available, without blocking
+ *
+ * The characters are gathered in the input buffer. When a line is complete
+ * it is terminated with a NUL byte and its length is returned. If there is
+ * no complete line yet -1 is returned, the partial line is kept for the next
+ * call.
+ *
+ * Each complete line is first offered to the URC handlers. If a handler
+ * says the wait must be aborted (e.g. "+PDP: DEACT") -2 is returned.
+ */
+int GPRSbeeClass::pollLine()
+{
+  if (_inputBuffer == NULL) {
+    return -1;
+  }
+
+  int c;
+  size_t len;
+  while (true) {
+    if (_lineSeenCR) {
       c = _modemStream->peek();
-      // ts_waitLF is guaranteed to be non-zero
-      if ((c == -1 && isTimedOut(ts_waitLF)) || (c != -1 && c != '\n')) {
-        //diagPrint(F("readLine:  peek '")); diagPrint(c); diagPrintLn('\'');
+      // _lineTsWaitLF is guaranteed to be valid
+      if ((c == -1 && isTimedOut(_lineTsWaitLF)) || (c != -1 && c != '\n')) {
         // Line ended with just <CR>. That's OK too.
-        goto ok;
+        break;
+      }
+      if (c == -1) {
+        // Keep waiting for the optional LF
+        return -1;
       }
       // Only \n should fall through
     }
 
-    c = _modemStream->read();
+    c = modemRead();
     if (c < 0) {
-      continue;
+      return -1;
     }
-    diagPrint((char)c);                 // echo the char
-    seenCR = c == '\r';
+    _lineSeenCR = c == '\r';
     if (c == '\r') {
-      ts_waitLF = millis() + 50;        // Wait another .05 sec for an optional LF
+      _lineTsWaitLF = millis() + 50;    // Wait another .05 sec for an optional LF
     } else if (c == '\n') {
-      goto ok;
+      break;
     } else {
       // Any other character is stored in the line buffer
-      if (bufcnt < (_inputBufferSize - 1)) {    // Leave room for the terminating NUL
-        _inputBuffer[bufcnt++] = c;
+      if (_lineLen < (_inputBufferSize - 1)) {  // Leave room for the terminating NUL
+        _inputBuffer[_lineLen++] = c;
       }
     }
   }
 
-  diagPrintLn(F("readLine timed out"));
-  return -1;            // This indicates: timed out
+  len = _lineLen;
+  _inputBuffer[len] = 0;        // Terminate with NUL byte
+  _lineLen = 0;
+  _lineSeenCR = false;
 
-ok:
-  _inputBuffer[bufcnt] = 0;     // Terminate with NUL byte
-  //diagPrint(F(" ")); diagPrintLn(_inputBuffer);
-  return bufcnt;
+  if (len > 0) {
+    if (_traceBuffer) {
+      traceBegin('R');
+      traceAdd(_inputBuffer, len);
+      traceEnd();
+    } else {
+      diagDebug(GPRSBEE_DIAG_AT, F("<< "));
+      diagDebugLn(GPRSBEE_DIAG_AT, _inputBuffer);
+    }
+  }
 
+  if (_muxOpen && handleSocketLine()) {
+    // The line was consumed, let the caller see an empty line
+    _inputBuffer[0] = 0;
+    return 0;
+  }
+  switch (handleURCLine()) {
+  case URCConsumed:
+    _inputBuffer[0] = 0;
+    return 0;
+  case URCAbort:
+    return -2;
+  default:
+    break;
+  }
+  return len;
 }
 
 /*
@@ -209,10 +518,10 @@ ok:
  */
 int GPRSbeeClass::readBytes(size_t len, uint8_t *buffer, size_t buflen, uint32_t ts_max)
 {
-  //diagPrintLn(F("readBytes"));
+  //diagDebugLn(GPRSBEE_DIAG_AT, F("readBytes"));
   while (!isTimedOut(ts_max) && len > 0) {
     wdt_reset();
-    int c = _modemStream->read();
+    int c = modemRead();
     if (c < 0) {
       continue;
     }
@@ -253,7 +562,7 @@ bool GPRSbeeClass::waitForOK(uint16_t timeout)
 bool GPRSbeeClass::waitForMessage(const char *msg, uint32_t ts_max)
 {
   int len;
-  //diagPrint(F("waitForMessage: ")); diagPrintLn(msg);
+  //diagDebug(GPRSBEE_DIAG_AT, F("waitForMessage: ")); diagDebugLn(GPRSBEE_DIAG_AT, msg);
   while ((len = readLine(ts_max)) >= 0) {
     if (len == 0) {
       // Skip empty lines
@@ -268,7 +577,7 @@ bool GPRSbeeClass::waitForMessage(const char *msg, uint32_t ts_max)
 bool GPRSbeeClass::waitForMessage_P(const char *msg, uint32_t ts_max)
 {
   int len;
-  //diagPrint(F("waitForMessage: ")); diagPrintLn(msg);
+  //diagDebug(GPRSBEE_DIAG_AT, F("waitForMessage: ")); diagDebugLn(GPRSBEE_DIAG_AT, msg);
   while ((len = readLine(ts_max)) >= 0) {
     if (len == 0) {
       // Skip empty lines
@@ -284,17 +593,17 @@ bool GPRSbeeClass::waitForMessage_P(const char *msg, uint32_t ts_max)
 int GPRSbeeClass::waitForMessages(PGM_P msgs[], size_t nrMsgs, uint32_t ts_max)
 {
   int len;
-  //diagPrint(F("waitForMessages: ")); diagPrintLn(msgs[0]);
+  //diagDebug(GPRSBEE_DIAG_AT, F("waitForMessages: ")); diagDebugLn(GPRSBEE_DIAG_AT, msgs[0]);
   while ((len = readLine(ts_max)) >= 0) {
     if (len == 0) {
       // Skip empty lines
       continue;
     }
-    //diagPrint(F(" checking \"")); diagPrint(_inputBuffer); diagPrintLn("\"");
+    //diagDebug(GPRSBEE_DIAG_AT, F(" checking \"")); diagDebug(GPRSBEE_DIAG_AT, _inputBuffer); diagDebugLn(GPRSBEE_DIAG_AT, "\"");
     for (size_t i = 0; i < nrMsgs; ++i) {
-      //diagPrint(F("  checking \"")); diagPrint(msgs[i]); diagPrintLn("\"");
+      //diagDebug(GPRSBEE_DIAG_AT, F("  checking \"")); diagDebug(GPRSBEE_DIAG_AT, msgs[i]); diagDebugLn(GPRSBEE_DIAG_AT, "\"");
       if (strcmp_P(_inputBuffer, msgs[i]) == 0) {
-        //diagPrint(F("  found i=")); diagPrint((int)i); diagPrintLn("");
+        //diagDebug(GPRSBEE_DIAG_AT, F("  found i=")); diagDebug(GPRSBEE_DIAG_AT, (int)i); diagDebugLn(GPRSBEE_DIAG_AT, "");
         return i;
       }
     }
@@ -317,12 +626,11 @@ bool GPRSbeeClass::waitForPrompt(const char *prompt, uint32_t ts_max)
       break;
     }
 
-    int c = _modemStream->read();
+    int c = modemRead();
     if (c < 0) {
       continue;
     }
 
-    diagPrint((char)c);
     switch (c) {
     case '\r':
       // Ignore
@@ -350,9 +658,10 @@ bool GPRSbeeClass::waitForPrompt(const char *prompt, uint32_t ts_max)
  */
 void GPRSbeeClass::sendCommandProlog()
 {
-  flushInput();
-  mydelay(50);                  // Without this we get lots of "readLine timed out". Unclear why
-  diagPrint(F(">> "));
+  // Don't start while SIM900 is still talking (leftover replies, URCs)
+  waitForLineIdle(GPRSBEE_LINE_IDLE_MS, 50);
+  diagDebug(GPRSBEE_DIAG_AT, F(">> "));
+  traceBegin('T');
 }
 
 /*
@@ -360,28 +669,222 @@ void GPRSbeeClass::sendCommandProlog()
  */
 void GPRSbeeClass::sendCommandAdd(char c)
 {
-  diagPrint(c);
-  _modemStream->print(c);
+  diagDebug(GPRSBEE_DIAG_AT, c);
+  traceAdd(&c, 1);
+  _txCount += _modemStream->print(c);
 }
 void GPRSbeeClass::sendCommandAdd(int i)
 {
-  diagPrint(i);
-  _modemStream->print(i);
+  // Room for a 32 bit int, some targets have one
+  char buffer[12];
+  itoa(i, buffer, 10);
+  sendCommandAdd(buffer);
 }
 void GPRSbeeClass::sendCommandAdd(const char *cmd)
 {
-  diagPrint(cmd);
-  _modemStream->print(cmd);
+  diagDebug(GPRSBEE_DIAG_AT, cmd);
+  traceAdd(cmd, strlen(cmd));
+  _txCount += _modemStream->print(cmd);
 }
 void GPRSbeeClass::sendCommandAdd(const String & cmd)
 {
-  diagPrint(cmd);
-  _modemStream->print(cmd);
+  sendCommandAdd(cmd.c_str());
 }
 void GPRSbeeClass::sendCommandAdd_P(const char *cmd)
 {
-  diagPrint(reinterpret_cast<const __FlashStringHelper *>(cmd));
-  _modemStream->print(reinterpret_cast<const __FlashStringHelper *>(cmd));
+  diagDebug(GPRSBEE_DIAG_AT, reinterpret_cast<const __FlashStringHelper *>(cmd));
+  traceAdd_P(cmd);
+  _txCount += _modemStream->print(reinterpret_cast<const __FlashStringHelper *>(cmd));
+}
+
+/*
+ * \brief Add a parameter of a command (see sendCommandArgs_P)
+ */
+void GPRSbeeClass::sendCommandParam(long value)
+{
+  char buffer[12];
+  ltoa(value, buffer, 10);
+  sendCommandAdd(buffer);
+}
+void GPRSbeeClass::sendCommandParam(unsigned long value)
+{
+  char buffer[12];
+  ultoa(value, buffer, 10);
+  sendCommandAdd(buffer);
+}
+/*
+ * \brief Add a string parameter of a command, in quotes
+ *
+ * SIMx00 has no way to escape a '"' inside a string, so it is left out.
+ * A NULL string is sent as "".
+ */
+void GPRSbeeClass::sendCommandParam(const char *str)
+{
+  sendCommandAdd('"');
+  if (str != NULL) {
+    if (strchr(str, '"') == NULL) {
+      sendCommandAdd(str);
+    } else {
+      for (; *str != '\0'; ++str) {
+        if (*str != '"') {
+          sendCommandAdd(*str);
+        }
+      }
+    }
+  }
+  sendCommandAdd('"');
+}
+void GPRSbeeClass::sendCommandParam(const __FlashStringHelper *str)
+{
+  sendCommandAdd('"');
+  sendCommandAdd_P(reinterpret_cast<const char *>(str));
+  sendCommandAdd('"');
+}
+
+/*
+ * \brief Go to the next pass of a command batch
+ *
+ * The first pass collects the commands in one line, or sends them one by
+ * one if the firmware is known to reject that. At the end of the first
+ * pass the line is finished and we wait for the OK. If that fails, a
+ * second pass sends the commands one by one. If the batch got an ERROR
+ * and they all succeed that way, the firmware does not accept batches and
+ * we don't try it again. A timeout says nothing about the firmware.
+ *
+ * \return true if the commands must be given (again)
+ */
+bool GPRSbeeClass::batchNext()
+{
+  switch (_batchPass++) {
+  case 0:
+    _batchMode = !_batchUnsupported;
+    _batchOK = true;
+    _batchCount = 0;
+    return true;
+
+  case 1:
+    if (!_batchMode) {
+      return false;
+    }
+    _batchRejected = false;
+    if (_batchCount > 0) {
+      PGM_P replies[] = {
+          PSTR("OK"),
+          PSTR("ERROR"),
+      };
+      sendCommandEpilog();
+      int ix = waitForMessages(replies, sizeof(replies) / sizeof(replies[0]), millis() + 4000);
+      _batchOK = ix == 0;
+      _batchRejected = ix == 1;
+    }
+    if (_batchOK || _batchCount <= 1) {
+      return false;
+    }
+    // Maybe the firmware does not like it, try one by one
+    _batchMode = false;
+    _batchOK = true;
+    _batchCount = 0;
+    return true;
+
+  default:
+    if (_batchOK && _batchRejected) {
+      diagInfoLn(GPRSBEE_DIAG_AT, F("Command batch not accepted"));
+      _batchUnsupported = true;
+    }
+    return false;
+  }
+}
+
+/*
+ * \brief Start a command of a batch, \a cmd is the command without "AT"
+ *
+ * \return false if the command must be skipped, because an earlier one failed
+ */
+bool GPRSbeeClass::batchAdd_P(const char *cmd)
+{
+  if (!_batchOK) {
+    return false;
+  }
+  if (!_batchMode || _batchCount == 0) {
+    sendCommandProlog();
+    sendCommandAdd_P(PSTR("AT"));
+  } else {
+    sendCommandAdd(';');
+  }
+  sendCommandAdd_P(cmd);
+  ++_batchCount;
+  return true;
+}
+
+/*
+ * \brief Write a block of (binary) data to SIM900
+ *
+ * This is for the payload after a prompt, it is not echoed to the diag
+ * stream. The data is written in chunks of GPRSBEE_TX_CHUNK_SIZE.
+ */
+void GPRSbeeClass::writeData(const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    size_t chunk = len;
+    if (chunk > GPRSBEE_TX_CHUNK_SIZE) {
+      chunk = GPRSBEE_TX_CHUNK_SIZE;
+    }
+    wdt_reset();
+    _txCount += _modemStream->write(data, chunk);
+    data += chunk;
+    len -= chunk;
+  }
+}
+
+/*
+ * \brief Write data to SIM900, getting the bytes from a read function
+ */
+void GPRSbeeClass::writeData(uint8_t (*read)(), size_t len)
+{
+  uint8_t buffer[GPRSBEE_TX_CHUNK_SIZE];
+  while (len > 0) {
+    size_t chunk = len;
+    if (chunk > sizeof(buffer)) {
+      chunk = sizeof(buffer);
+    }
+    for (size_t i = 0; i < chunk; ++i) {
+      buffer[i] = (*read)();
+    }
+    writeData(buffer, chunk);
+    len -= chunk;
+  }
+}
+
+/*
+ * \brief Write data to SIM900, getting blocks of bytes from a producer
+ *
+ * The SIM900 takes everything up to the announced length as data, even a
+ * next command. So if the producer stops early the rest is filled up with
+ * spaces.
+ *
+ * \return false if the producer did not deliver all the bytes
+ */
+bool GPRSbeeClass::writeData(GPRSbeeDataProducer producer, size_t len)
+{
+  uint8_t buffer[GPRSBEE_TX_CHUNK_SIZE];
+  bool complete = true;
+  while (len > 0) {
+    size_t chunk = len;
+    if (chunk > sizeof(buffer)) {
+      chunk = sizeof(buffer);
+    }
+    if (complete) {
+      chunk = (*producer)(buffer, chunk);
+      if (chunk == 0) {
+        complete = false;
+        memset(buffer, ' ', sizeof(buffer));
+        continue;
+      }
+    }
+    writeData(buffer, chunk);
+    len -= chunk;
+  }
+  return complete;
 }
 
 /*
@@ -389,8 +892,9 @@ void GPRSbeeClass::sendCommandAdd_P(const char *cmd)
  */
 void GPRSbeeClass::sendCommandEpilog()
 {
-  diagPrintLn();
-  _modemStream->print('\r');
+  diagDebugLn(GPRSBEE_DIAG_AT);
+  traceEnd();
+  _txCount += _modemStream->print('\r');
 }
 
 void GPRSbeeClass::sendCommand(const char *cmd)
@@ -415,18 +919,181 @@ void GPRSbeeClass::sendCommand_P(const char *cmd)
  */
 bool GPRSbeeClass::sendCommandWaitForOK(const char *cmd, uint16_t timeout)
 {
-  sendCommand(cmd);
-  return waitForOK(timeout);
+  GPRSbeeCommand command(cmd, timeout);
+  queueCommand(command);
+  return waitForCommand(command);
 }
 bool GPRSbeeClass::sendCommandWaitForOK(const String & cmd, uint16_t timeout)
 {
-  sendCommand(cmd.c_str());
-  return waitForOK(timeout);
+  return sendCommandWaitForOK(cmd.c_str(), timeout);
 }
 bool GPRSbeeClass::sendCommandWaitForOK_P(const char *cmd, uint16_t timeout)
 {
-  sendCommand_P(cmd);
-  return waitForOK(timeout);
+  GPRSbeeCommand command(cmd, timeout);
+  queueCommand_P(command);
+  return waitForCommand(command);
+}
+
+/*
+ * \brief Add a command to the queue of commands to be sent to the SIM900
+ *
+ * The command object is owned by the caller and must stay alive until
+ * it is done. The command is sent by poll() as soon as the commands
+ * before it are done.
+ */
+bool GPRSbeeClass::queueCommand(GPRSbeeCommand & cmd)
+{
+  cmd.inProgmem = false;
+  return enqueueCommand(cmd);
+}
+bool GPRSbeeClass::queueCommand_P(GPRSbeeCommand & cmd)
+{
+  cmd.inProgmem = true;
+  return enqueueCommand(cmd);
+}
+
+bool GPRSbeeClass::enqueueCommand(GPRSbeeCommand & cmd)
+{
+  if (cmd.state == CommandQueued || cmd.state == CommandBusy) {
+    // It is already in the queue
+    return false;
+  }
+  cmd.state = CommandQueued;
+  cmd._next = NULL;
+  if (_commandQueue == NULL) {
+    _commandQueue = &cmd;
+  } else {
+    GPRSbeeCommand * last = _commandQueue;
+    while (last->_next != NULL) {
+      last = last->_next;
+    }
+    last->_next = &cmd;
+  }
+  return true;
+}
+
+/*
+ * \brief Make progress with the queued commands, without blocking
+ *
+ * This sends the next command when the previous one is done, and it
+ * matches the input of SIM900 with the command that is in progress.
+ * It must be called often, e.g. from loop().
+ *
+ * \return true if there are still commands queued or in progress
+ */
+bool GPRSbeeClass::poll()
+{
+  if (_currentCommand == NULL && _commandQueue != NULL) {
+    startCommand();
+  }
+
+  int len = 0;
+  while (_currentCommand != NULL && (len = pollLine()) >= 0) {
+    if (len == 0) {
+      // Skip empty lines
+      continue;
+    }
+    handleCommandLine(*_currentCommand);
+    if (_currentCommand->isDone()) {
+      finishCommand();
+    }
+  }
+  if (_currentCommand != NULL && len == -2) {
+    // A URC (e.g. +PDP: DEACT) tells us not to wait any longer
+    _currentCommand->state = CommandError;
+    finishCommand();
+  }
+
+  if (_currentCommand != NULL && isTimedOut(_currentCommand->_ts_max)) {
+    diagErrorLn(GPRSBEE_DIAG_AT, F("command timed out"));
+    _currentCommand->state = CommandTimeout;
+    finishCommand();
+  }
+
+  if (_currentCommand == NULL && _commandQueue == NULL && !_inWaitForCommand) {
+    // Only from the poll() of the user, not in the middle of an operation
+    checkHTTPSessionLinger();
+  }
+
+  return _currentCommand != NULL || _commandQueue != NULL;
+}
+
+/*
+ * \brief Wait until a queued command is done
+ *
+ * This is what turns the non-blocking poll() into the classic blocking
+ * functions.
+ */
+bool GPRSbeeClass::waitForCommand(GPRSbeeCommand & cmd)
+{
+  bool wasWaiting = _inWaitForCommand;
+  _inWaitForCommand = true;
+  while (cmd.state == CommandQueued || cmd.state == CommandBusy) {
+    wdt_reset();
+    poll();
+  }
+  _inWaitForCommand = wasWaiting;
+  return cmd.isOK();
+}
+
+void GPRSbeeClass::startCommand()
+{
+  GPRSbeeCommand * cmd = _commandQueue;
+  _commandQueue = cmd->_next;
+  cmd->_next = NULL;
+  _currentCommand = cmd;
+
+  cmd->_seenOK = false;
+  cmd->_seenReply = false;
+  if (cmd->inProgmem) {
+    sendCommand_P(cmd->cmd);
+  } else {
+    sendCommand(cmd->cmd);
+  }
+  cmd->state = CommandBusy;
+  cmd->_ts_max = millis() + cmd->timeout;
+}
+
+void GPRSbeeClass::handleCommandLine(GPRSbeeCommand & cmd)
+{
+  size_t replyLen = 0;
+  if (cmd.reply != NULL && !cmd._seenReply) {
+    replyLen = cmd.inProgmem ? strlen_P(cmd.reply) : strlen(cmd.reply);
+    if ((cmd.inProgmem ? strncmp_P(_inputBuffer, cmd.reply, replyLen) : strncmp(_inputBuffer, cmd.reply, replyLen)) != 0) {
+      replyLen = 0;
+    }
+  }
+
+  if (replyLen > 0) {
+    cmd._seenReply = true;
+    if (cmd.replyBuffer != NULL && cmd.replyBufferSize > 0) {
+      const char *ptr = skipWhiteSpace(_inputBuffer + replyLen);
+      strncpy(cmd.replyBuffer, ptr, cmd.replyBufferSize - 1);
+      cmd.replyBuffer[cmd.replyBufferSize - 1] = '\0';  // Terminate, just to be sure
+    }
+  }
+  else if (strcmp_P(_inputBuffer, PSTR("OK")) == 0) {
+    cmd._seenOK = true;
+  }
+  else if (strcmp_P(_inputBuffer, PSTR("ERROR")) == 0) {
+    cmd.state = CommandError;
+    return;
+  }
+  // Other input is skipped.
+
+  if (cmd._seenOK && (cmd.reply == NULL || cmd._seenReply)) {
+    cmd.state = CommandOK;
+  }
+}
+
+void GPRSbeeClass::finishCommand()
+{
+  GPRSbeeCommand * cmd = _currentCommand;
+  // The callback is allowed to queue a new command
+  _currentCommand = NULL;
+  if (cmd->callback != NULL) {
+    cmd->callback(*cmd);
+  }
 }
 
 /*
@@ -449,13 +1116,13 @@ bool GPRSbeeClass::getIntValue(const char *cmd, const char *reply, int * value,
 
   // First we expect the reply
   if (waitForMessage(reply, ts_max)) {
-    const char *ptr = _inputBuffer + strlen(reply);
-    char *bufend;
-    *value = strtoul(ptr, &bufend, 0);
-    if (bufend == ptr) {
+    GPRSbeeFields fields(_inputBuffer + strlen(reply), false);
+    int32_t v;
+    if (!fields.nextInt(&v)) {
       // Invalid number
       return false;
     }
+    *value = v;
     // Wait for "OK"
     return waitForOK();
   }
@@ -468,13 +1135,13 @@ bool GPRSbeeClass::getIntValue_P(const char *cmd, const char *reply, int * value
 
   // First we expect the reply
   if (waitForMessage_P(reply, ts_max)) {
-    const char *ptr = _inputBuffer + strlen_P(reply);
-    char *bufend;
-    *value = strtoul(ptr, &bufend, 0);
-    if (bufend == ptr) {
+    GPRSbeeFields fields(_inputBuffer + strlen_P(reply), false);
+    int32_t v;
+    if (!fields.nextInt(&v)) {
       // Invalid number
       return false;
     }
+    *value = v;
     // Wait for "OK"
     return waitForOK();
   }
@@ -504,12 +1171,8 @@ bool GPRSbeeClass::getStrValue(const char *cmd, const char *reply, char * str, s
   sendCommand(cmd);
 
   if (waitForMessage(reply, ts_max)) {
-    const char *ptr = _inputBuffer + strlen(reply);
-    // Strip leading white space
-    while (*ptr != '\0' && *ptr == ' ') {
-      ++ptr;
-    }
-    strncpy(str, ptr, size - 1);
+    GPRSbeeFields fields(_inputBuffer + strlen(reply), false);
+    strncpy(str, fields.rest(), size - 1);
     str[size - 1] = '\0';               // Terminate, just to be sure
     // Wait for "OK"
     return waitForOK();
@@ -522,12 +1185,8 @@ bool GPRSbeeClass::getStrValue_P(const char *cmd, const char *reply, char * str,
   sendCommand_P(cmd);
 
   if (waitForMessage_P(reply, ts_max)) {
-    const char *ptr = _inputBuffer + strlen_P(reply);
-    // Strip leading white space
-    while (*ptr != '\0' && *ptr == ' ') {
-      ++ptr;
-    }
-    strncpy(str, ptr, size - 1);
+    GPRSbeeFields fields(_inputBuffer + strlen_P(reply), false);
+    strncpy(str, fields.rest(), size - 1);
     str[size - 1] = '\0';               // Terminate, just to be sure
     // Wait for "OK"
     return waitForOK();
@@ -625,12 +1284,22 @@ bool GPRSbeeClass::networkOn()
 bool GPRSbeeClass::getRSSIAndBER(int8_t* rssi, uint8_t* ber)
 {
     static char berValues[] = { 49, 43, 37, 25, 19, 13, 7, 0 }; // 3GPP TS 45.008 [20] subclause 8.2.4
-    int rssiRaw = 0;
-    int berRaw = 0;
-    // TODO get BER value
-    if (getIntValue("AT+CSQ", "+CSQ:", &rssiRaw, millis() + 12000 )) {
-        *rssi = ((rssiRaw == 99) ? 0 : -113 + 2 * rssiRaw);
-        *ber = ((berRaw == 99 || static_cast<size_t>(berRaw) >= sizeof(berValues)) ? 0 : berValues[berRaw]);
+    int32_t rssiRaw = 0;
+    int32_t berRaw = 0;
+
+    // +CSQ: <rssi>,<ber>
+    sendCommand_P(PSTR("AT+CSQ"));
+    if (waitForMessage_P(PSTR("+CSQ:"), millis() + 12000)) {
+        GPRSbeeFields fields(_inputBuffer);
+        if (!fields.nextInt(&rssiRaw)) {
+            return false;
+        }
+        fields.nextInt(&berRaw);
+        if (!waitForOK()) {
+            return false;
+        }
+        *rssi = ((rssiRaw == 99) ? 0 : -113 + 2 * rssiRaw);
+        *ber = ((berRaw == 99 || berRaw < 0 || static_cast<size_t>(berRaw) >= sizeof(berValues)) ? 0 : berValues[berRaw]);
 
         return true;
     }
@@ -650,56 +1319,151 @@ bool GPRSbeeClass::waitForSignalQuality()
     int8_t rssi;
     uint8_t ber;
 
+    // A good signal a short while ago is good enough
+    if (_goodSignalSeen && _signalSkipTime != 0 && (start - _goodSignalTs) < _signalSkipTime) {
+        _CSQtime = 0;
+        return true;
+    }
+
+    _rssiCount = 0;
     while (!isTimedOut(ts_max)) {
         if (getRSSIAndBER(&rssi, &ber)) {
+            addRSSI(rssi);
             if (rssi != 0 && rssi >= _minSignalQuality) {
                 _lastRSSI = rssi;
                 _CSQtime = (int32_t) (millis() - start) / 1000;
+                if (rssi >= _minSignalQuality + GPRSBEE_CSQ_GOOD_MARGIN) {
+                    _goodSignalSeen = true;
+                    _goodSignalTs = millis();
+                }
+                recordPhase(PhaseCSQ, start);
                 return true;
             }
+            if ((millis() - start) >= GPRSBEE_CSQ_ABORT_TIME && !isSignalHopeful()) {
+                diagErrorLn(GPRSBEE_DIAG_POWER, F("No usable signal, giving up"));
+                break;
+            }
         }
         /*sodaq_wdt_safe_*/ delay(500);
     }
     _lastRSSI = 0;
+    _goodSignalSeen = false;
+    recordPhase(PhaseCSQ, start);
     return false;
 }
 
+/*
+ * \brief Add an RSSI value to the history of waitForSignalQuality
+ */
+void GPRSbeeClass::addRSSI(int8_t rssi)
+{
+    if (_rssiCount >= GPRSBEE_CSQ_HISTORY) {
+        memmove(&_rssiHistory[0], &_rssiHistory[1], GPRSBEE_CSQ_HISTORY - 1);
+        _rssiCount = GPRSBEE_CSQ_HISTORY - 1;
+    }
+    // No signal (99) counts as just below the lowest value (-113 dBm)
+    _rssiHistory[_rssiCount++] = rssi == 0 ? -115 : rssi;
+}
+
+/*
+ * \brief Is there still a chance of getting a usable signal?
+ *
+ * It is if the best value in the history is not far below the minimum,
+ * or if the signal is going up.
+ */
+bool GPRSbeeClass::isSignalHopeful()
+{
+    if (_rssiCount < 2) {
+        return true;
+    }
+    int8_t best = _rssiHistory[0];
+    for (uint8_t i = 1; i < _rssiCount; ++i) {
+        if (_rssiHistory[i] > best) {
+            best = _rssiHistory[i];
+        }
+    }
+    if (best >= _minSignalQuality - GPRSBEE_CSQ_ABORT_MARGIN) {
+        return true;
+    }
+    return _rssiHistory[_rssiCount - 1] > _rssiHistory[0];
+}
+
 bool GPRSbeeClass::waitForCREG()
 {
   // TODO This timeout is maybe too long.
-  uint32_t ts_max = millis() + 120000;
-  int value;
+  uint32_t start = millis();
+  uint32_t ts_max = start + 120000;
+  uint32_t ts_check;
+
+  // The status comes in as +CREG: <stat> when it changes. See
+  // handleURC_CREG for the values.
+  if (!enableRegistrationURC()) {
+    return false;
+  }
+  ts_check = millis() + GPRSBEE_CREG_CHECK_INTERVAL;
   while (!isTimedOut(ts_max)) {
-    sendCommand_P(PSTR("AT+CREG?"));
-    // Reply is:
-    // +CREG: <n>,<stat>[,<lac>,<ci>]   mostly this is +CREG: 0,1
-    // we want the second number, the <stat>
-    // 0 = Not registered, MT is not currently searching an operator to register to
-    // 1 = Registered, home network
-    // 2 = Not registered, but MT is currently trying to attach...
-    // 3 = Registration denied
-    // 4 = Unknown
-    // 5 = Registered, roaming
-    value = 0;
-    if (waitForMessage_P(PSTR("+CREG:"), millis() + 12000)) {
-      const char *ptr = strchr(_inputBuffer, ',');
-      if (ptr) {
-        ++ptr;
-        value = strtoul(ptr, NULL, 0);
-      }
-    }
-    waitForOK();
-    if (value == 1 || value == 5) {
+    wdt_reset();
+    if (_cregStat == 1 || _cregStat == 5) {
+      _CREGtime = (millis() - _startOn) / 1000;
+      recordPhase(PhaseCREG, start);
+      setEnergyState(EnergyIdle);
       return true;
     }
-    mydelay(500);
-    if (!isAlive()) {
-      break;
+    if (pollLine() >= 0) {
+      continue;
+    }
+    if (isTimedOut(ts_check)) {
+      // Nothing happened for a while. This also tells us the modem is still alive.
+      if (!sendCommandWaitForOK_P(PSTR("AT+CREG?"))) {
+        break;
+      }
+      ts_check = millis() + GPRSBEE_CREG_CHECK_INTERVAL;
     }
   }
+  recordPhase(PhaseCREG, start);
   return false;
 }
 
+/*!
+ * \brief Let the modem tell us about changes of the registration
+ *
+ * This is done once per power cycle. The current status is asked for
+ * once, after that +CREG: and +CGREG: come in by themselves.
+ */
+bool GPRSbeeClass::enableRegistrationURC()
+{
+  if (_registrationURC) {
+    return true;
+  }
+  if (!sendCommandWaitForOK_P(PSTR("AT+CREG=1"))) {
+    return false;
+  }
+  // Not all firmware knows AT+CGREG
+  sendCommandWaitForOK_P(PSTR("AT+CGREG=1"));
+  // +CREG: <n>,<stat>
+  if (!sendCommandWaitForOK_P(PSTR("AT+CREG?"))) {
+    return false;
+  }
+  _registrationURC = true;
+  return true;
+}
+
+/*!
+ * \brief Is the modem registered to the network?
+ *
+ * This does not block. It only looks at the +CREG: that came in, so it can
+ * be called from loop() while the MCU does other things.
+ */
+bool GPRSbeeClass::isRegistered()
+{
+  if (!enableRegistrationURC()) {
+    return false;
+  }
+  while (pollLine() >= 0) {
+  }
+  return _cregStat == 1 || _cregStat == 5;
+}
+
 /*!
  * \brief Do a few common things to start a connection
  *
@@ -713,6 +1477,13 @@ bool GPRSbeeClass::connectProlog()
   // Suppress echoing
   switchEchoOff();
 
+  // A faster UART, if asked for. It's not an error if the rate stays the same.
+  if (_targetBaudrate != 0 && _targetBaudrate != getBaudrate() && _targetBaudrate != _failedBaudrate) {
+    if (!changeBaudrate(_targetBaudrate)) {
+      return false;
+    }
+  }
+
   // Wait for signal quality
   if (!waitForSignalQuality()) {
     return false;
@@ -733,8 +1504,15 @@ bool GPRSbeeClass::connectProlog()
 
   // Attach to GPRS service
   // We need a longer timeout than the normal waitForOK
-  if (!_skipCGATT && !sendCommandWaitForOK_P(PSTR("AT+CGATT=1"), 30000)) {
-    return false;
+  if (!_skipCGATT) {
+    uint32_t start = millis();
+    setEnergyState(EnergyAttaching);
+    bool attached = sendCommandWaitForOK_P(PSTR("AT+CGATT=1"), 30000);
+    recordPhase(PhaseCGATT, start);
+    setEnergyState(EnergyIdle);
+    if (!attached) {
+      return false;
+    }
   }
 
   return true;
@@ -764,8 +1542,8 @@ bool GPRSbeeClass::openTCP(const char *apn, const char *apnuser, const char *apn
     const char *server, int port, bool transMode)
 {
   uint32_t ts_max;
+  uint32_t start;
   boolean retval = false;
-  char cmdbuf[60];              // big enough for AT+CIPSTART="TCP","server",8500
   PGM_P CIPSTART_replies[] = {
       PSTR("CONNECT OK"),
       PSTR("CONNECT"),
@@ -783,19 +1561,11 @@ bool GPRSbeeClass::openTCP(const char *apn, const char *apnuser, const char *apn
     goto cmd_error;
   }
 
+  start = millis();
+  setEnergyState(EnergyAttaching);
   // AT+CSTT=<apn>,<username>,<password>
-  strcpy_P(cmdbuf, PSTR("AT+CSTT=\""));
-  strcat(cmdbuf, apn);
-  strcat(cmdbuf, "\",\"");
-  if (apnuser) {
-    strcat(cmdbuf, apnuser);
-  }
-  strcat(cmdbuf, "\",\"");
-  if (apnpwd) {
-    strcat(cmdbuf, apnpwd);
-  }
-  strcat(cmdbuf, "\"");
-  if (!sendCommandWaitForOK(cmdbuf)) {
+  sendCommandArgs_P(PSTR("AT+CSTT="), apn, apnuser, apnpwd);
+  if (!waitForOK()) {
     goto cmd_error;
   }
 
@@ -816,25 +1586,58 @@ bool GPRSbeeClass::openTCP(const char *apn, const char *apnuser, const char *apn
   if (!waitForMessage_P(PSTR("SHUT OK"), ts_max)) {
     goto cmd_error;
   }
+  recordPhase(PhaseBearer, start);
+  setEnergyState(EnergyIdle);
+
+  if (_muxOpen) {
+    // The sockets are gone with the CIPSHUT. Back to single connection mode.
+    resetSockets();
+    if (!sendCommandWaitForOK_P(PSTR("AT+CIPMUX=0"))) {
+      goto cmd_error;
+    }
+  }
 
   if (transMode) {
     if (!sendCommandWaitForOK_P(PSTR("AT+CIPMODE=1"))) {
       goto cmd_error;
     }
-    //AT+CIPCCFG
-    // Read the current settings
-    if (!sendCommandWaitForOK_P(PSTR("AT+CIPCCFG?"))) {
+    // AT+CIPCCFG=<NmRetry>,<WaitTm>,<SendSz>,<esc>
+    // <WaitTm> is the packing interval (in 200 ms units), <SendSz> the
+    // number of bytes that triggers a send. <esc> enables "+++".
+    sendCommandProlog();
+    sendCommandAdd_P(PSTR("AT+CIPCCFG=5,"));
+    sendCommandAdd((int)_transWaitTm);
+    sendCommandAdd(',');
+    sendCommandAdd((int)_transSendSz);
+    sendCommandAdd_P(PSTR(",1"));
+    sendCommandEpilog();
+    if (!waitForOK()) {
+      goto cmd_error;
+    }
+  }
+
+  _tcpRx.clear();
+  _tcpDataPending = false;
+  if (_tcpRxGet && !transMode) {
+    // Let SIM900 keep the received data until we ask for it
+    if (_tcpRxBuffer == NULL) {
+      // Allocated once, and never freed. Just like the input buffer.
+      _tcpRxBuffer = static_cast<uint8_t *>(malloc(GPRSBEE_TCP_RX_BUFFER_SIZE));
+      if (_tcpRxBuffer == NULL) {
+        goto cmd_error;
+      }
+      _tcpRx.init(_tcpRxBuffer, GPRSBEE_TCP_RX_BUFFER_SIZE);
+    }
+    if (!sendCommandWaitForOK_P(PSTR("AT+CIPRXGET=1"))) {
       goto cmd_error;
     }
   }
 
   // Start up the connection
   // AT+CIPSTART="TCP","server",8500
-  strcpy_P(cmdbuf, PSTR("AT+CIPSTART=\"TCP\",\""));
-  strcat(cmdbuf, server);
-  strcat_P(cmdbuf, PSTR("\","));
-  itoa(port, cmdbuf + strlen(cmdbuf), 10);
-  if (!sendCommandWaitForOK(cmdbuf)) {
+  start = millis();
+  sendCommandArgs_P(PSTR("AT+CIPSTART="), F("TCP"), server, port);
+  if (!waitForOK()) {
     goto cmd_error;
   }
   ts_max = millis() + 15000;            // Is this enough?
@@ -850,19 +1653,41 @@ bool GPRSbeeClass::openTCP(const char *apn, const char *apnuser, const char *apn
     // Only some CIPSTART_replies are acceptable, i.e. "CONNECT" and "CONNECT OK"
     goto cmd_error;
   }
+  recordPhase(PhaseAction, start);
 
   // AT+CIPQSEND=0  normal send mode (reply after each data send will be SEND OK)
   if (false && !sendCommandWaitForOK_P(PSTR("AT+CIPQSEND=0"))) {
     goto cmd_error;
   }
 
+  _tcpMaxSend = GPRSBEE_MAX_SEND_SIZE;
+  if (_tcpQuickSend && !transMode) {
+    // AT+CIPQSEND=1  quick send mode (reply after each data send will be DATA ACCEPT:<len>)
+    if (!sendCommandWaitForOK_P(PSTR("AT+CIPQSEND=1"))) {
+      goto cmd_error;
+    }
+    // AT+CIPSPRT=0  no "> " prompt, AT+CIPSPRT=1 with prompt
+    if (!sendCommandWaitForOK_P(_tcpSendPrompt ? PSTR("AT+CIPSPRT=1") : PSTR("AT+CIPSPRT=0"))) {
+      goto cmd_error;
+    }
+    // Ask how much data can be sent at once
+    // +CIPSEND: <size>
+    int maxSend;
+    if (getIntValue_P(PSTR("AT+CIPSEND?"), PSTR("+CIPSEND:"), &maxSend, millis() + 4000)
+        && maxSend > 0 && maxSend < (int)_tcpMaxSend) {
+      _tcpMaxSend = maxSend;
+    }
+  }
+
   _transMode = transMode;
+  _transLastData = millis();
+  _tcpClosed = false;
   retval = true;
   _timeToOpenTCP = millis() - _startOn;
   goto ending;
 
 cmd_error:
-  diagPrintLn(F("openTCP failed!"));
+  diagErrorLn(GPRSBEE_DIAG_TCP, F("openTCP failed!"));
   off();
 
 ending:
@@ -875,15 +1700,12 @@ void GPRSbeeClass::closeTCP(bool switchOff)
   // AT+CIPSHUT
   // Maybe we should do AT+CIPCLOSE=1
   if (_transMode) {
-    mydelay(1000);
-    _modemStream->print(F("+++"));
-    mydelay(500);
-    // TODO Will the SIM900 answer with "OK"?
+    switchToCommandMode();
   }
   sendCommand_P(PSTR("AT+CIPSHUT"));
   ts_max = millis() + 4000;             // Is this enough?
   if (!waitForMessage_P(PSTR("SHUT OK"), ts_max)) {
-    diagPrintLn(F("closeTCP failed!"));
+    diagErrorLn(GPRSBEE_DIAG_TCP, F("closeTCP failed!"));
   }
 
   if (switchOff) {
@@ -904,10 +1726,7 @@ bool GPRSbeeClass::isTCPConnected()
 
   if (_transMode) {
     // We need to send +++
-    mydelay(1000);
-    _modemStream->print(F("+++"));
-    mydelay(500);
-    if (!waitForOK()) {
+    if (!switchToCommandMode()) {
       goto end;
     }
   }
@@ -924,10 +1743,9 @@ bool GPRSbeeClass::isTCPConnected()
   if (!waitForMessage_P(PSTR("STATE:"), ts_max)) {
     goto end;
   }
-  ptr = _inputBuffer + 6;
-  ptr = skipWhiteSpace(ptr);
   // Look at the state
-  if (strcmp_P(ptr, PSTR("CONNECT OK")) != 0) {
+  ptr = GPRSbeeFields(_inputBuffer).nextStr();
+  if (ptr == NULL || strcmp_P(ptr, PSTR("CONNECT OK")) != 0) {
     goto end;
   }
 
@@ -941,20 +1759,94 @@ bool GPRSbeeClass::isTCPConnected()
     }
   }
 
+  _transLastData = millis();
   retval = true;
 
 end:
   return retval;
 }
 
+/*!
+ * \brief Switch from transparent mode to command mode
+ *
+ * The "+++" must be preceded and followed by a guard time without
+ * data. When the pump has already been idle long enough we don't have
+ * to wait before the "+++". After it we just wait for the "OK".
+ */
+bool GPRSbeeClass::switchToCommandMode()
+{
+  uint32_t idle = millis() - _transLastData;
+  if (idle < _escapeGuardTime) {
+    mydelay(_escapeGuardTime - idle);
+  }
+  diagDebugLn(GPRSBEE_DIAG_TCP, F(">> +++"));
+  _txCount += _modemStream->print(F("+++"));
+  return waitForOK(_escapeGuardTime + 1000);
+}
+
+/*!
+ * \brief Pump data between a Stream and the transparent TCP connection
+ *
+ * The TCP connection must have been opened in transparent mode. Data is
+ * copied in both directions until neither side has had data for
+ * idleTimeout ms. The connection stays in transparent mode.
+ *
+ * \return the number of bytes that were copied
+ */
+size_t GPRSbeeClass::transparentPump(Stream & stream, uint16_t idleTimeout)
+{
+  uint8_t buffer[GPRSBEE_TX_CHUNK_SIZE];
+  size_t count = 0;
+
+  if (!_transMode) {
+    return 0;
+  }
+
+  uint32_t ts_idle = millis() + idleTimeout;
+  while (!isTimedOut(ts_idle)) {
+    wdt_reset();
+    size_t len = 0;
+    int c;
+    while (len < sizeof(buffer) && (c = stream.read()) >= 0) {
+      buffer[len++] = c;
+    }
+    if (len > 0) {
+      writeData(buffer, len);
+    }
+
+    size_t rlen = 0;
+    while (rlen < sizeof(buffer) && (c = modemRead()) >= 0) {
+      buffer[rlen++] = c;
+    }
+    if (rlen > 0) {
+      stream.write(buffer, rlen);
+    }
+
+    if (len > 0 || rlen > 0) {
+      count += len + rlen;
+      _transLastData = millis();
+      ts_idle = _transLastData + idleTimeout;
+    }
+  }
+
+  return count;
+}
+
 /*!
  * \brief Send some data over the TCP connection
  */
 bool GPRSbeeClass::sendDataTCP(const uint8_t *data, size_t data_len)
 {
   uint32_t ts_max;
+  uint32_t start = millis();
   bool retval = false;
 
+  setEnergyState(EnergyTransmitting);
+  if (_tcpQuickSend && !_transMode) {
+    retval = sendDataTCPQuick(data, data_len);
+    goto ending;
+  }
+
   sendCommandProlog();
   sendCommandAdd_P(PSTR("AT+CIPSEND="));
   sendCommandAdd((int)data_len);
@@ -965,9 +1857,7 @@ bool GPRSbeeClass::sendDataTCP(const uint8_t *data, size_t data_len)
   }
   mydelay(50);          // TODO Why do we need this?
   // Send the data
-  for (size_t i = 0; i < data_len; ++i) {
-    _modemStream->print((char)*data++);
-  }
+  writeData(data, data_len);
   //
   ts_max = millis() + 4000;             // Is this enough?
   if (!waitForMessage_P(PSTR("SEND OK"), ts_max)) {
@@ -977,11 +1867,82 @@ bool GPRSbeeClass::sendDataTCP(const uint8_t *data, size_t data_len)
   retval = true;
   goto ending;
 error:
-  diagPrintLn(F("sendDataTCP failed!"));
+  diagErrorLn(GPRSBEE_DIAG_TCP, F("sendDataTCP failed!"));
 ending:
+  recordPhase(PhaseData, start);
+  setEnergyState(EnergyIdle);
   return retval;
 }
 
+/*!
+ * \brief Send data over the TCP connection, in quick send mode
+ *
+ * The data is split up in segments of at most the size that SIM900
+ * accepts with one AT+CIPSEND. Each segment is acknowledged with
+ * "DATA ACCEPT:<len>" as soon as SIM900 has it in its buffer, we
+ * don't wait for the remote side. Without the "> " prompt (see
+ * setTCPQuickSend) the data follows the command right away.
+ *
+ * This is not windowed: there is only one AT+CIPSEND at a time, the
+ * next segment waits for the DATA ACCEPT of the previous one. SIMCom
+ * does not promise that the modem takes a new command line while the
+ * previous one is still running. What is saved is the wait for the
+ * remote side (SEND OK), and with the prompt off the wait for "> ".
+ */
+bool GPRSbeeClass::sendDataTCPQuick(const uint8_t *data, size_t data_len)
+{
+  while (data_len > 0) {
+    size_t segment = data_len;
+    if (segment > _tcpMaxSend) {
+      segment = _tcpMaxSend;
+    }
+
+    sendCommandArgs_P(PSTR("AT+CIPSEND="), segment);
+    if (_tcpSendPrompt && !waitForPrompt("> ", millis() + 4000)) {
+      goto error;
+    }
+    writeData(data, segment);
+    if (!waitForDataAccept(segment, millis() + 4000)) {
+      goto error;
+    }
+
+    data += segment;
+    data_len -= segment;
+  }
+  return true;
+
+error:
+  diagErrorLn(GPRSBEE_DIAG_TCP, F("sendDataTCP failed!"));
+  return false;
+}
+
+/*!
+ * \brief Wait for "DATA ACCEPT:<len>"
+ *
+ * \return false if not all of the len bytes were accepted, or if it timed out
+ */
+bool GPRSbeeClass::waitForDataAccept(size_t len, uint32_t ts_max)
+{
+  int lineLen;
+  while ((lineLen = readLine(ts_max)) >= 0) {
+    if (lineLen == 0) {
+      // Skip empty lines
+      continue;
+    }
+    if (strncmp_P(_inputBuffer, PSTR("DATA ACCEPT:"), 12) == 0) {
+      GPRSbeeFields fields(_inputBuffer);
+      int32_t accepted;
+      return fields.nextInt(&accepted) && accepted >= 0 && (size_t)accepted == len;
+    }
+    if (strcmp_P(_inputBuffer, PSTR("SEND FAIL")) == 0
+        || strcmp_P(_inputBuffer, PSTR("ERROR")) == 0
+        || strcmp_P(_inputBuffer, PSTR("CLOSED")) == 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
 /*!
  * \brief Receive a number of bytes from the TCP connection
  *
@@ -993,12 +1954,18 @@ bool GPRSbeeClass::receiveDataTCP(uint8_t *data, size_t data_len, uint16_t timeo
   uint32_t ts_max;
   bool retval = false;
 
-  //diagPrintLn(F("receiveDataTCP"));
+  //diagDebugLn(GPRSBEE_DIAG_AT, F("receiveDataTCP"));
   ts_max = millis() + timeout;
+  setEnergyState(EnergyReceiving);
+  if (_tcpRxGet && !_transMode) {
+    retval = receiveDataTCPRxGet(data, data_len, ts_max);
+    setEnergyState(EnergyIdle);
+    return retval;
+  }
   while (data_len > 0 && !isTimedOut(ts_max)) {
     if (_modemStream->available() > 0) {
       uint8_t b;
-      b = _modemStream->read();
+      b = modemRead();
       *data++ = b;
       --data_len;
     }
@@ -1007,124 +1974,445 @@ bool GPRSbeeClass::receiveDataTCP(uint8_t *data, size_t data_len, uint16_t timeo
     retval = true;
   }
 
+  setEnergyState(EnergyIdle);
   return retval;
 }
 
 /*!
- * \brief Receive a line of ASCII via the TCP connection
+ * \brief Receive a number of bytes, with AT+CIPRXGET
+ *
+ * SIM900 keeps the received data. It tells us with "+CIPRXGET: 1" that
+ * there is new data, and we fetch it with AT+CIPRXGET=2,<len>. We never
+ * ask for more than what fits in the receive buffer.
  */
-bool GPRSbeeClass::receiveLineTCP(const char **buffer, uint16_t timeout)
+bool GPRSbeeClass::receiveDataTCPRxGet(uint8_t *data, size_t data_len, uint32_t ts_max)
 {
-  uint32_t ts_max;
-  bool retval = false;
+  // Ask once anyway, the "+CIPRXGET: 1" may have been discarded.
+  bool fetch = true;
+  while (true) {
+    size_t n = _tcpRx.read(data, data_len);
+    data += n;
+    data_len -= n;
+    if (data_len == 0) {
+      return true;
+    }
+    if (isTimedOut(ts_max)) {
+      break;
+    }
 
-  //diagPrintLn(F("receiveLineTCP"));
-  *buffer = NULL;
-  ts_max = millis() + timeout;
-  if (readLine(ts_max) < 0) {
-    goto ending;
+    if (fetch || _tcpDataPending) {
+      size_t len = _tcpRx.space();
+      if (len > data_len) {
+        len = data_len;
+      }
+      if (!fetchTCPData(len)) {
+        break;
+      }
+      fetch = false;
+    } else {
+      // Wait for "+CIPRXGET: 1", see handleURCLine
+      wdt_reset();
+      if (pollLine() == -2) {
+        break;
+      }
+    }
   }
-  *buffer = _inputBuffer;
-  retval = true;
-
-ending:
-  return retval;
+  return false;
 }
 
-/*
- * \brief Open a (FTP) session
+/*!
+ * \brief Fetch received data from SIM900 into the receive buffer
+ *
+ * Expected reply:
+ *   +CIPRXGET: 2,<reqlength>,<cnflength>
+ *   <data>
+ *   OK
+ * <cnflength> is what is still left in SIM900
  */
-bool GPRSbeeClass::openFTP(const char *apn,
-    const char *server, const char *username, const char *password)
-{
-  return openFTP(apn, 0, 0, server, username, password);
-}
-
-bool GPRSbeeClass::openFTP(const char *apn, const char *apnuser, const char *apnpwd,
-    const char *server, const char *username, const char *password)
+bool GPRSbeeClass::fetchTCPData(size_t len)
 {
-  char cmd[64];
+  uint32_t ts_max;
 
-  if (!on()) {
-    goto ending;
+  // Never more than what fits
+  if (len > _tcpRx.space()) {
+    len = _tcpRx.space();
   }
-
-  if (!connectProlog()) {
-    goto cmd_error;
+  if (len > 1460) {
+    // The maximum <reqlength>
+    len = 1460;
   }
-
-  if (!setBearerParms(apn, apnuser, apnpwd)) {
-    goto cmd_error;
+  if (len == 0) {
+    return true;
   }
-
-  if (!sendCommandWaitForOK_P(PSTR("AT+FTPCID=1"))) {
-    goto cmd_error;
+  sendCommandArgs_P(PSTR("AT+CIPRXGET=2,"), len);
+  ts_max = millis() + 4000;
+  if (!waitForRxGetReply(ts_max)) {
+    return false;
   }
-
-  // connect to FTP server
-  //snprintf(cmd, sizeof(cmd), "AT+FTPSERV=\"%s\"", server);
-  strcpy_P(cmd, PSTR("AT+FTPSERV=\""));
-  strcat(cmd, server);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
-    goto cmd_error;
+  // +CIPRXGET: 2,<reqlength>,<cnflength>
+  GPRSbeeFields fields(_inputBuffer);
+  int32_t cnfLength = 0;
+  int32_t value = 0;
+  fields.skip();
+  if (!fields.nextInt(&value) || value < 0) {
+    // We don't know how much data follows, skip everything up to the OK
+    waitForOK();
+    return false;
+  }
+  if ((size_t)value > len) {
+    // More than we asked for, it would not fit. Drop it all, the data must
+    // not be taken for the next reply.
+    readBytes(value, NULL, 0, millis() + 1000);
+    waitForOK();
+    return false;
   }
+  len = value;
+  _tcpDataPending = fields.nextInt(&cnfLength) && cnfLength > 0;
 
-  // optional "AT+FTPPORT=21";
-  //snprintf(cmd, sizeof(cmd), "AT+FTPUN=\"%s\"", username);
-  strcpy_P(cmd, PSTR("AT+FTPUN=\""));
-  strcat(cmd, username);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
-    goto cmd_error;
+  ts_max = millis() + 1000;
+  while (len > 0 && !isTimedOut(ts_max)) {
+    int c = modemRead();
+    if (c < 0) {
+      continue;
+    }
+    --len;
+    _tcpRx.put(c);
   }
-  //snprintf(cmd, sizeof(cmd), "AT+FTPPW=\"%s\"", password);
-  strcpy_P(cmd, PSTR("AT+FTPPW=\""));
-  strcat(cmd, password);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
-    goto cmd_error;
+  if (len > 0) {
+    return false;
   }
+  return waitForOK();
+}
 
-  return true;
+/*!
+ * \brief Wait for the reply to AT+CIPRXGET=2
+ *
+ *   +CIPRXGET: 2,...
+ * SIM900 may leave out the space.
+ */
+bool GPRSbeeClass::waitForRxGetReply(uint32_t ts_max)
+{
+  while (waitForMessage_P(PSTR("+CIPRXGET:"), ts_max)) {
+    GPRSbeeFields fields(_inputBuffer);
+    int32_t mode;
+    if (fields.nextInt(&mode) && mode == 2) {
+      return true;
+    }
+  }
+  return false;
+}
 
-cmd_error:
-  diagPrintLn(F("openFTP failed!"));
-  off();
+static const char urc_CIPRXGET[] PROGMEM = "+CIPRXGET:";
+static const char urc_CREG[] PROGMEM = "+CREG:";
+static const char urc_CGREG[] PROGMEM = "+CGREG:";
+static const char urc_CMTI[] PROGMEM = "+CMTI:";
+static const char urc_CLOSED[] PROGMEM = "CLOSED";
+static const char urc_PDP_DEACT[] PROGMEM = "+PDP: DEACT";
+static const char urc_SAPBR_DEACT[] PROGMEM = "+SAPBR 1: DEACT";
+static const char urc_RDY[] PROGMEM = "RDY";
+static const char urc_CallReady[] PROGMEM = "Call Ready";
+static const char urc_SMSReady[] PROGMEM = "SMS Ready";
+static const char urc_PSUTTZ[] PROGMEM = "*PSUTTZ:";
 
-ending:
-  return false;
+/*
+ * The table of unsolicited result codes (URC)
+ *
+ * Each line is matched against the prefixes. The handler of the first
+ * match gets the rest of the line. The prefixes end at the ':', SIM900
+ * often leaves out the space after it and GPRSbeeFields skips it anyway.
+ */
+const GPRSbeeClass::URCEntry GPRSbeeClass::_urcTable[] PROGMEM = {
+  { urc_CIPRXGET,       &GPRSbeeClass::handleURC_CIPRXGET },
+  { urc_CREG,           &GPRSbeeClass::handleURC_CREG },
+  { urc_CGREG,          &GPRSbeeClass::handleURC_CGREG },
+  { urc_CMTI,           &GPRSbeeClass::handleURC_CMTI },
+  { urc_CLOSED,         &GPRSbeeClass::handleURC_CLOSED },
+  { urc_PDP_DEACT,      &GPRSbeeClass::handleURC_DEACT },
+  { urc_SAPBR_DEACT,    &GPRSbeeClass::handleURC_DEACT },
+  { urc_RDY,            &GPRSbeeClass::handleURC_RDY },
+  { urc_CallReady,      &GPRSbeeClass::handleURC_CallReady },
+  { urc_SMSReady,       &GPRSbeeClass::handleURC_CallReady },
+  { urc_PSUTTZ,         &GPRSbeeClass::handleURC_PSUTTZ },
+};
+
+/*!
+ * \brief Handle the lines of SIM900 that are unsolicited (URC)
+ *
+ * This is called for each line read by pollLine. The line is looked up
+ * in the URC table.
+ *
+ * \return what pollLine must do with the line
+ */
+GPRSbeeClass::URCResults GPRSbeeClass::handleURCLine()
+{
+  for (size_t i = 0; i < sizeof(_urcTable) / sizeof(_urcTable[0]); ++i) {
+    URCEntry entry;
+    memcpy_P(&entry, &_urcTable[i], sizeof(entry));
+    size_t len = strlen_P(entry.prefix);
+    if (strncmp_P(_inputBuffer, entry.prefix, len) == 0) {
+      URCResults result = (this->*entry.handler)(_inputBuffer + len);
+      if (_urcCallback) {
+        _urcCallback(_inputBuffer);
+      }
+      return result;
+    }
+  }
+  return URCPass;
 }
 
-bool GPRSbeeClass::closeFTP()
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CIPRXGET(char *arg)
 {
-  off();            // Ignore errors
-  return true;
+  // "+CIPRXGET: 1" on its own, or "+CIPRXGET: 1,<n>" for a socket. The
+  // other modes are replies to AT+CIPRXGET.
+  GPRSbeeFields fields(arg, false);
+  int32_t mode;
+  if (!fields.nextInt(&mode) || mode != 1) {
+    return URCPass;
+  }
+  if (_tcpRxGet && fields.atEnd()) {
+    _tcpDataPending = true;
+    return URCConsumed;
+  }
+  int32_t socket;
+  if (_muxOpen && fields.nextInt(&socket)) {
+    if (socket >= 0 && socket < GPRSBEE_MAX_SOCKETS) {
+      _sockets[socket].dataPending = true;
+    }
+    return URCConsumed;
+  }
+  return URCPass;
 }
 
 /*
- * \brief Open a (FTP) session (one file)
+ * \brief Get the <stat> from +CREG: or +CGREG:
+ *
+ * +CREG: <stat>[,<lac>,<ci>]          (URC, AT+CREG=1 or 2)
+ * +CREG: <n>,<stat>[,<lac>,<ci>]      (reply to AT+CREG?)
+ *
+ * 0 = Not registered, MT is not currently searching an operator to register to
+ * 1 = Registered, home network
+ * 2 = Not registered, but MT is currently trying to attach...
+ * 3 = Registration denied
+ * 4 = Unknown
+ * 5 = Registered, roaming
  */
-bool GPRSbeeClass::openFTPfile(const char *fname, const char *path)
+static uint8_t parseRegistrationStat(char *arg)
 {
-  char cmd[64];
-  const char * ptr;
+  GPRSbeeFields fields(arg, false);
+  int32_t stat = 0;
+  fields.nextInt(&stat);
+  // The <lac> is quoted, a second number is the <stat>
+  if (*fields.rest() != '"') {
+    fields.nextInt(&stat);
+  }
+  return stat;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CREG(char *arg)
+{
+  _cregStat = parseRegistrationStat(arg);
+  // Someone may be waiting for the reply of AT+CREG?, so don't consume it.
+  return URCPass;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CGREG(char *arg)
+{
+  _cgregStat = parseRegistrationStat(arg);
+  return URCPass;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CMTI(char *arg)
+{
+  // +CMTI: <mem>,<index>
+  GPRSbeeFields fields(arg, false);
+  int32_t index;
+  if (fields.skip() && fields.nextInt(&index)) {
+    _newSMSIndex = index;
+  }
+  return URCConsumed;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CLOSED(char *arg)
+{
+  // The TCP connection was closed by the other side. The line is also
+  // used as the answer to AT+CIPSEND.
+  if (*arg == '\0') {
+    _tcpClosed = true;
+  }
+  return URCPass;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_DEACT(char *)
+{
+  // +PDP: DEACT or +SAPBR 1: DEACT
+  // The network dropped the context. There is no point in waiting for
+  // whatever we were waiting for.
+  _bearerOpen = false;
+  _localIP = NO_IP_ADDRESS;
+  // The sockets are gone too
+  resetSockets();
+  _tcpClosed = true;
+  return URCAbort;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_RDY(char *)
+{
+  // The modem (re)started, everything we knew about it is gone
+  resetState();
+  return URCConsumed;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_CallReady(char *)
+{
+  _callReady = true;
+  return URCConsumed;
+}
+
+GPRSbeeClass::URCResults GPRSbeeClass::handleURC_PSUTTZ(char *arg)
+{
+  // *PSUTTZ: <year>,<month>,<day>,<hour>,<min>,<sec>,"<tz>",<dst>
+  // The year has four digits, the timezone is in quarters of an hour
+  GPRSbeeFields fields(arg, false);
+  int32_t v[7];
+  for (uint8_t i = 0; i < 7; ++i) {
+    if (!fields.nextInt(&v[i])) {
+      return URCConsumed;
+    }
+  }
+  int8_t tz = v[6];
+  SIMDateTime dt(v[0] % 100, v[1] - 1, v[2] - 1, v[3], v[4], v[5], tz);
+  _networkTime = dt.getY2KEpoch();
+  _networkTimeTs = millis();
+  if (_networkTimeTs == 0) {
+    _networkTimeTs = 1;
+  }
+  return URCConsumed;
+}
+
+/*!
+ * \brief Get the index of an SMS that came in (+CMTI:)
+ *
+ * \return the index, or -1 if no SMS came in since the last call
+ */
+int GPRSbeeClass::getNewSMSIndex()
+{
+  // Pick up pending URCs
+  while (pollLine() >= 0) {
+  }
+  int index = _newSMSIndex;
+  _newSMSIndex = -1;
+  return index;
+}
+
+/*!
+ * \brief Get the time the network sent us (*PSUTTZ:)
+ *
+ * The time is kept going with millis().
+ *
+ * \return false if the network never sent the time
+ */
+bool GPRSbeeClass::getNetworkTime(uint32_t & ts)
+{
+  if (_networkTimeTs == 0) {
+    return false;
+  }
+  ts = _networkTime + (millis() - _networkTimeTs) / 1000;
+  return true;
+}
+
+/*!
+ * \brief Receive a line of ASCII via the TCP connection
+ *
+ * This does not work when AT+CIPRXGET is used (setTCPRxGet).
+ */
+bool GPRSbeeClass::receiveLineTCP(const char **buffer, uint16_t timeout)
+{
+  uint32_t ts_max;
+  bool retval = false;
+
+  //diagDebugLn(GPRSBEE_DIAG_AT, F("receiveLineTCP"));
+  *buffer = NULL;
+  ts_max = millis() + timeout;
+  if (readLine(ts_max) < 0) {
+    goto ending;
+  }
+  *buffer = _inputBuffer;
+  retval = true;
+
+ending:
+  return retval;
+}
+
+/*
+ * \brief Open a (FTP) session
+ */
+bool GPRSbeeClass::openFTP(const char *apn,
+    const char *server, const char *username, const char *password)
+{
+  return openFTP(apn, 0, 0, server, username, password);
+}
+
+bool GPRSbeeClass::openFTP(const char *apn, const char *apnuser, const char *apnpwd,
+    const char *server, const char *username, const char *password)
+{
+  if (!on()) {
+    goto ending;
+  }
+
+  if (!connectProlog()) {
+    goto cmd_error;
+  }
+
+  if (!setBearerParms(apn, apnuser, apnpwd)) {
+    goto cmd_error;
+  }
+
+  // connect to FTP server
+  // optional "AT+FTPPORT=21";
+  for (batchBegin(); batchNext(); ) {
+    batchArgs_P(PSTR("+FTPCID="), 1);
+    batchArgs_P(PSTR("+FTPSERV="), server);
+    batchArgs_P(PSTR("+FTPUN="), username);
+    batchArgs_P(PSTR("+FTPPW="), password);
+  }
+  if (!batchOK()) {
+    goto cmd_error;
+  }
+
+  _timeToOpenFTP = millis() - _startOn;
+  return true;
+
+cmd_error:
+  diagErrorLn(GPRSBEE_DIAG_FTP, F("openFTP failed!"));
+  off();
+
+ending:
+  return false;
+}
+
+bool GPRSbeeClass::closeFTP()
+{
+  off();            // Ignore errors
+  _timeToCloseFTP = millis() - _startOn;
+  return true;
+}
+
+/*
+ * \brief Open a (FTP) session (one file)
+ */
+bool GPRSbeeClass::openFTPfile(const char *fname, const char *path)
+{
+  int32_t maxLength;
   int retry;
   uint32_t ts_max;
 
   // Open FTP file
-  //snprintf(cmd, sizeof(cmd), "AT+FTPPUTNAME=\"%s\"", fname);
-  strcpy_P(cmd, PSTR("AT+FTPPUTNAME=\""));
-  strcat(cmd, fname);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
+  sendCommandArgs_P(PSTR("AT+FTPPUTNAME="), fname);
+  if (!waitForOK()) {
     goto ending;
   }
-  //snprintf(cmd, sizeof(cmd), "AT+FTPPUTPATH=\"%s\"", FTPPATH);
-  strcpy_P(cmd, PSTR("AT+FTPPUTPATH=\""));
-  strcat(cmd, path);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
+  sendCommandArgs_P(PSTR("AT+FTPPUTPATH="), path);
+  if (!waitForOK()) {
     goto ending;
   }
 
@@ -1141,22 +2429,11 @@ bool GPRSbeeClass::openFTPfile(const char *fname, const char *path)
         isAlive();
         continue;
       }
-      // Skip 8 for "+FTPPUT:"
-      ptr = _inputBuffer + 8;
-      ptr = skipWhiteSpace(ptr);
-      if (strncmp_P(ptr, PSTR("1,"), 2) != 0) {
-        // We did NOT get "+FTPPUT:1,1,", it might be an error.
-        goto ending;
-      }
-      ptr += 2;
-
-      if (strncmp_P(ptr, PSTR("1,"), 2) != 0) {
+      if (!parseFTPPUT(1, &maxLength) || maxLength <= 0) {
         // We did NOT get "+FTPPUT:1,1,", it might be an error.
         goto ending;
       }
-      ptr += 2;
-
-      _ftpMaxLength = strtoul(ptr, NULL, 0);
+      _ftpMaxLength = maxLength;
 
       break;
     }
@@ -1192,7 +2469,7 @@ bool GPRSbeeClass::closeFTPfile()
   uint32_t ts_max = millis() + 20000;
   if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)) {
     // How bad is it if we ignore this
-    //diagPrintLn(F("Timeout while waiting for +FTPPUT:1,"));
+    //diagDebugLn(GPRSBEE_DIAG_AT, F("Timeout while waiting for +FTPPUT:1,"));
   }
 
   return true;
@@ -1206,28 +2483,23 @@ bool GPRSbeeClass::closeFTPfile()
  */
 bool GPRSbeeClass::sendFTPdata_low(uint8_t *buffer, size_t size)
 {
-  char cmd[20];         // Should be enough for "AT+FTPPUT=2,<num>"
   uint32_t ts_max;
   uint8_t *ptr = buffer;
+  int32_t cnfLength;
 
   // Send some data
-  //snprintf(cmd, sizeof(cmd), "AT+FTPPUT=2,%d", size);
-  strcpy_P(cmd, PSTR("AT+FTPPUT=2,"));
-  itoa(size, cmd + strlen(cmd), 10);
-  sendCommand(cmd);
+  sendCommandArgs_P(PSTR("AT+FTPPUT="), 2, size);
 
   ts_max = millis() + 10000;
   // +FTPPUT:2,22
-  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)) {
-    // How bad is it if we ignore this
+  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)
+      || !parseFTPPUT(2, &cnfLength) || cnfLength != (int32_t)size) {
     return false;
   }
   mydelay(100);           // TODO Find out if we can drop this
 
   // Send data ...
-  for (size_t i = 0; i < size; ++i) {
-    _modemStream->print((char)*ptr++);
-  }
+  writeData(ptr, size);
   //_modemStream->print('\r');          // dummy <CR>, not sure if this is needed
 
   // Expected reply:
@@ -1242,9 +2514,9 @@ bool GPRSbeeClass::sendFTPdata_low(uint8_t *buffer, size_t size)
   // The SIM900 informs again what the new max length is
   ts_max = millis() + 4000;
   // +FTPPUT:1,1,1360
-  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)) {
-    // How bad is it if we ignore this?
-    // It informs us about the _ftpMaxLength
+  if (waitForMessage_P(PSTR("+FTPPUT:"), ts_max)
+      && parseFTPPUT(1, &cnfLength) && cnfLength > 0) {
+    _ftpMaxLength = cnfLength;
   }
 
   return true;
@@ -1252,35 +2524,23 @@ bool GPRSbeeClass::sendFTPdata_low(uint8_t *buffer, size_t size)
 
 bool GPRSbeeClass::sendFTPdata_low(uint8_t (*read)(), size_t size)
 {
-  char cmd[20];         // Should be enough for "AT+FTPPUT=2,<num>"
-  const char * ptr;
   uint32_t ts_max;
+  int32_t cnfLength;
 
   // Send some data
-  //snprintf(cmd, sizeof(cmd), "AT+FTPPUT=2,%d", size);
-  strcpy_P(cmd, PSTR("AT+FTPPUT=2,"));
-  itoa(size, cmd + strlen(cmd), 10);
-  sendCommand(cmd);
+  sendCommandArgs_P(PSTR("AT+FTPPUT="), 2, size);
 
   ts_max = millis() + 10000;
   // +FTPPUT:2,22
-  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)) {
-    ptr = _inputBuffer + 8;
-    if (strncmp_P(ptr, PSTR("2,"), 2) != 0) {
-      // We did NOT get "+FTPPUT:2,", it might be an error.
-      return false;
-    }
-    ptr += 2;
-    // TODO Check for the number
-    // How bad is it if we ignore this
+  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)
+      || !parseFTPPUT(2, &cnfLength) || cnfLength != (int32_t)size) {
+    // We did NOT get "+FTPPUT:2,<size>", it might be an error.
     return false;
   }
   mydelay(100);           // TODO Find out if we can drop this
 
   // Send data ...
-  for (size_t i = 0; i < size; ++i) {
-    _modemStream->print((char)(*read)());
-  }
+  writeData(read, size);
 
   // Expected reply:
   // +FTPPUT:2,22
@@ -1294,51 +2554,84 @@ bool GPRSbeeClass::sendFTPdata_low(uint8_t (*read)(), size_t size)
   // The SIM900 informs again what the new max length is
   ts_max = millis() + 30000;
   // +FTPPUT:1,1,1360
-  if (!waitForMessage_P(PSTR("+FTPPUT:"), ts_max)) {
-    // How bad is it if we ignore this?
-    // It informs us about the _ftpMaxLength
+  if (waitForMessage_P(PSTR("+FTPPUT:"), ts_max)
+      && parseFTPPUT(1, &cnfLength) && cnfLength > 0) {
+    _ftpMaxLength = cnfLength;
   }
 
   return true;
 }
 
+/*
+ * \brief Parse the +FTPPUT: line in the input buffer
+ *
+ *   +FTPPUT:1,1,<maxlength>      (mode 1, session opened)
+ *   +FTPPUT:1,<error>            (mode 1, e.g. 61 net error)
+ *   +FTPPUT:2,<cnflength>        (mode 2, ready to accept the data)
+ *
+ * \return true if it is a good reply for \a mode, \a value gets the number
+ */
+bool GPRSbeeClass::parseFTPPUT(uint8_t mode, int32_t *value)
+{
+  GPRSbeeFields fields(_inputBuffer);
+  int32_t v;
+  if (!fields.nextInt(&v) || v != mode) {
+    return false;
+  }
+  if (mode == 1 && (!fields.nextInt(&v) || v != 1)) {
+    return false;
+  }
+  return fields.nextInt(value);
+}
+
 bool GPRSbeeClass::sendFTPdata(uint8_t *data, size_t size)
 {
   // Send the bytes in chunks that are maximized by the maximum
   // FTP length
+  uint32_t start = millis();
+  bool retval = true;
+  setEnergyState(EnergyTransmitting);
   while (size > 0) {
     size_t my_size = size;
     if (my_size > _ftpMaxLength) {
       my_size = _ftpMaxLength;
     }
     if (!sendFTPdata_low(data, my_size)) {
-      return false;
+      retval = false;
+      break;
     }
     data += my_size;
     size -= my_size;
   }
-  return true;
+  recordPhase(PhaseData, start);
+  setEnergyState(EnergyIdle);
+  return retval;
 }
 bool GPRSbeeClass::sendFTPdata(uint8_t (*read)(), size_t size)
 {
   // Send the bytes in chunks that are maximized by the maximum
   // FTP length
+  uint32_t start = millis();
+  bool retval = true;
+  setEnergyState(EnergyTransmitting);
   while (size > 0) {
     size_t my_size = size;
     if (my_size > _ftpMaxLength) {
       my_size = _ftpMaxLength;
     }
     if (!sendFTPdata_low(read, my_size)) {
-      return false;
+      retval = false;
+      break;
     }
     size -= my_size;
   }
-  return true;
+  recordPhase(PhaseData, start);
+  setEnergyState(EnergyIdle);
+  return retval;
 }
 
 bool GPRSbeeClass::sendSMS(const char *telno, const char *text)
 {
-  char cmd[64];
   uint32_t ts_max;
   bool retval = false;
 
@@ -1363,16 +2656,13 @@ bool GPRSbeeClass::sendSMS(const char *telno, const char *text)
     goto cmd_error;
   }
 
-  strcpy_P(cmd, PSTR("AT+CMGS=\""));
-  strcat(cmd, telno);
-  strcat(cmd, "\"");
-  sendCommand(cmd);
+  sendCommandArgs_P(PSTR("AT+CMGS="), telno);
   ts_max = millis() + 4000;
   if (!waitForPrompt("> ", ts_max)) {
     goto cmd_error;
   }
-  _modemStream->print(text); //the message itself
-  _modemStream->print((char)26); //the ASCII code of ctrl+z is 26, this is needed to end the send modus and send the message.
+  _txCount += _modemStream->print(text); //the message itself
+  _txCount += _modemStream->print((char)26); //the ASCII code of ctrl+z is 26, this is needed to end the send modus and send the message.
   if (!waitForOK(30000)) {
     goto cmd_error;
   }
@@ -1381,7 +2671,7 @@ bool GPRSbeeClass::sendSMS(const char *telno, const char *text)
   goto ending;
 
 cmd_error:
-  diagPrintLn(F("sendSMS failed!"));
+  diagErrorLn(GPRSBEE_DIAG_AT, F("sendSMS failed!"));
 
 ending:
   off();
@@ -1397,21 +2687,35 @@ ending:
  *  - HTTPACTION(1)
  */
 bool GPRSbeeClass::doHTTPPOSTmiddle(const char *url, const char *buffer, size_t len)
+{
+  return doHTTPPOSTmiddle(url, buffer, NULL, len);
+}
+
+/*!
+ * \brief The middle part of the whole HTTP POST, the data comes from a producer
+ *
+ * The producer is called to fill blocks of at most GPRSBEE_TX_CHUNK_SIZE
+ * bytes, until len bytes are sent.
+ */
+bool GPRSbeeClass::doHTTPPOSTmiddle(const char *url, GPRSbeeDataProducer producer, size_t len)
+{
+  return doHTTPPOSTmiddle(url, NULL, producer, len);
+}
+
+bool GPRSbeeClass::doHTTPPOSTmiddle(const char *url, const char *buffer, GPRSbeeDataProducer producer, size_t len)
 {
   uint32_t ts_max;
+  uint32_t start;
   bool retval = false;
   char num_bytes[16];
 
   // set http param URL value
-  sendCommandProlog();
-  sendCommandAdd_P(PSTR("AT+HTTPPARA=\"URL\",\""));
-  sendCommandAdd(url);
-  sendCommandAdd('"');
-  sendCommandEpilog();
+  sendCommandArgs_P(PSTR("AT+HTTPPARA="), F("URL"), url);
   if (!waitForOK()) {
     goto ending;
   }
 
+  start = millis();
   sendCommandProlog();
   sendCommandAdd_P(PSTR("AT+HTTPDATA="));
   itoa(len, num_bytes, 10);
@@ -1424,13 +2728,20 @@ bool GPRSbeeClass::doHTTPPOSTmiddle(const char *url, const char *buffer, size_t
   }
 
   // Send data ...
-  for (size_t i = 0; i < len; ++i) {
-    _modemStream->print(*buffer++);
+  if (producer) {
+    if (!writeData(producer, len)) {
+      // Don't POST the padding, but let the HTTPDATA finish first
+      waitForOK();
+      goto ending;
+    }
+  } else {
+    writeData((const uint8_t *)buffer, len);
   }
 
   if (!waitForOK()) {
     goto ending;
   }
+  recordPhase(PhaseData, start);
 
   if (!doHTTPACTION(1)) {
     goto ending;
@@ -1483,11 +2794,7 @@ bool GPRSbeeClass::doHTTPGETmiddle(const char *url, char *buffer, size_t len)
   bool retval = false;
 
   // set http param URL value
-  sendCommandProlog();
-  sendCommandAdd_P(PSTR("AT+HTTPPARA=\"URL\",\""));
-  sendCommandAdd(url);
-  sendCommandAdd('"');
-  sendCommandEpilog();
+  sendCommandArgs_P(PSTR("AT+HTTPPARA="), F("URL"), url);
   if (!waitForOK()) {
     goto ending;
   }
@@ -1536,6 +2843,7 @@ bool GPRSbeeClass::doHTTPprolog(const char *apn, const char *apnuser, const char
     goto ending;
   }
 
+  _httpInitDone = true;
   retval = true;
 
 ending:
@@ -1547,6 +2855,7 @@ void GPRSbeeClass::doHTTPepilog()
   if (!sendCommandWaitForOK_P(PSTR("AT+HTTPTERM"))) {
     // This is an error, but we can still return success.
   }
+  _httpInitDone = false;
 }
 
 /*
@@ -1555,6 +2864,7 @@ void GPRSbeeClass::doHTTPepilog()
 bool GPRSbeeClass::doHTTPREAD(char *buffer, size_t len)
 {
   uint32_t ts_max;
+  uint32_t start = millis();
   size_t getLength = 0;
   int i;
   bool retval = false;
@@ -1566,13 +2876,13 @@ bool GPRSbeeClass::doHTTPREAD(char *buffer, size_t len)
   sendCommand_P(PSTR("AT+HTTPREAD"));
   ts_max = millis() + 8000;
   if (waitForMessage_P(PSTR("+HTTPREAD:"), ts_max)) {
-    const char *ptr = _inputBuffer + 10;
-    char *bufend;
-    getLength = strtoul(ptr, &bufend, 0);
-    if (bufend == ptr) {
+    GPRSbeeFields fields(_inputBuffer);
+    int32_t value;
+    if (!fields.nextInt(&value) || value < 0) {
       // Invalid number
       goto ending;
     }
+    getLength = value;
   } else {
     // Hmm. Why didn't we get this?
     goto ending;
@@ -1595,15 +2905,127 @@ bool GPRSbeeClass::doHTTPREAD(char *buffer, size_t len)
   // All is well if we get here.
 
 ending:
+  recordPhase(PhaseData, start);
   return retval;
 }
 
+/*
+ * \brief Read the data from a GET or POST in chunks, and write it to a Print
+ *
+ * The data is fetched with AT+HTTPREAD=<start>,<size> windows of at most
+ * chunkSize bytes. It is passed on while it is read, so a big reply
+ * does not have to fit in RAM.
+ */
+bool GPRSbeeClass::doHTTPREAD(Print & sink, size_t chunkSize)
+{
+  uint32_t start = millis();
+  bool retval = doHTTPREADchunked(&sink, NULL, chunkSize);
+  recordPhase(PhaseData, start);
+  return retval;
+}
+
+/*
+ * \brief Read the data from a GET or POST in chunks, and pass it to a callback
+ *
+ * The callback is called with pieces of at most GPRSBEE_RX_PIECE_SIZE bytes.
+ */
+bool GPRSbeeClass::doHTTPREAD(GPRSbeeDataCallback callback, size_t chunkSize)
+{
+  uint32_t start = millis();
+  bool retval = doHTTPREADchunked(NULL, callback, chunkSize);
+  recordPhase(PhaseData, start);
+  return retval;
+}
+
+bool GPRSbeeClass::doHTTPREADchunked(Print * sink, GPRSbeeDataCallback callback, size_t chunkSize)
+{
+  uint32_t ts_max;
+  // The offset can be past 64K, more than a size_t of AVR
+  uint32_t start = 0;
+
+  if (chunkSize == 0) {
+    return false;
+  }
+
+  // Expect
+  //   +HTTPREAD: <date_len>
+  //   <data>
+  //   OK
+  // When the total length is not known we continue until a chunk is short.
+  // An empty body is not read at all, SIMx00 may say ERROR to that.
+  while (!_httpDataLenKnown || start < _httpDataLen) {
+    size_t size = chunkSize;
+    if (_httpDataLenKnown && size > _httpDataLen - start) {
+      size = _httpDataLen - start;
+    }
+
+    sendCommandArgs_P(PSTR("AT+HTTPREAD="), (unsigned long)start, (unsigned long)size);
+
+    ts_max = millis() + 8000;
+    if (!waitForMessage_P(PSTR("+HTTPREAD:"), ts_max)) {
+      return false;
+    }
+    GPRSbeeFields fields(_inputBuffer);
+    int32_t value;
+    if (!fields.nextInt(&value) || value < 0) {
+      // Invalid number
+      return false;
+    }
+    size_t getLength = value;
+
+    ts_max = millis() + 4000;
+    if (!readData(getLength, sink, callback, ts_max)) {
+      return false;
+    }
+    if (!waitForOK()) {
+      return false;
+    }
+
+    start += getLength;
+    if (getLength < size) {
+      // No more data
+      break;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * \brief Read a number of bytes from SIM900 and pass them on
+ */
+bool GPRSbeeClass::readData(size_t len, Print * sink, GPRSbeeDataCallback callback, uint32_t ts_max)
+{
+  uint8_t buffer[GPRSBEE_RX_PIECE_SIZE];
+  while (len > 0) {
+    size_t piece = len;
+    if (piece > sizeof(buffer)) {
+      piece = sizeof(buffer);
+    }
+    // readBytes terminates the string if there is room, we don't want that here
+    if (readBytes(piece, buffer, piece, ts_max) != 0) {
+      return false;
+    }
+    if (sink) {
+      sink->write(buffer, piece);
+    }
+    if (callback) {
+      callback(buffer, piece);
+    }
+    len -= piece;
+  }
+  return true;
+}
+
 bool GPRSbeeClass::doHTTPACTION(char num)
 {
   uint32_t ts_max;
+  uint32_t start = millis();
   bool retval = false;
 
   // set http action type 0 = GET, 1 = POST, 2 = HEAD
+  // Most of the time goes to sending the POST data or to receiving the reply
+  setEnergyState(num == 1 ? EnergyTransmitting : EnergyReceiving);
   sendCommandProlog();
   sendCommandAdd_P(PSTR("AT+HTTPACTION="));
   sendCommandAdd((int)num);
@@ -1619,18 +3041,19 @@ bool GPRSbeeClass::doHTTPACTION(char num)
   if (waitForMessage_P(PSTR("+HTTPACTION:"), ts_max)) {
     // SIM900 responds with: "+HTTPACTION:1,200,11"
     // SIM800 responds with: "+HTTPACTION: 1,200,11"
-    // The 12 is the length of "+HTTPACTION:"
-    // We then have to skip the digit and the comma
-    const char *ptr = _inputBuffer + 12;
-    ptr = skipWhiteSpace(ptr);
-    ++ptr;              // The digit
-    ++ptr;              // The comma
-    char *bufend;
-    uint8_t replycode = strtoul(ptr, &bufend, 0);
-    if (bufend == ptr) {
+    GPRSbeeFields fields(_inputBuffer);
+    int32_t replycode;
+    int32_t dataLen;
+    if (!fields.skip() || !fields.nextInt(&replycode)) {
       // Invalid number
       goto ending;
     }
+    // Remember <DataLen> for doHTTPREAD
+    _httpDataLen = 0;
+    _httpDataLenKnown = fields.nextInt(&dataLen) && dataLen >= 0;
+    if (_httpDataLenKnown) {
+      _httpDataLen = dataLen;
+    }
     // TODO Which result codes are allowed to pass?
     if (replycode == 200) {
       retval = true;
@@ -1642,6 +3065,8 @@ bool GPRSbeeClass::doHTTPACTION(char num)
   // All is well if we get here.
 
 ending:
+  recordPhase(PhaseAction, start);
+  setEnergyState(EnergyIdle);
   return retval;
 }
 
@@ -1652,6 +3077,23 @@ bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *url, const char *post
 
 bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
     const char *url, const char *postdata, size_t pdlen)
+{
+  return doHTTPPOST(apn, apnuser, apnpwd, url, postdata, NULL, pdlen);
+}
+
+bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *url, GPRSbeeDataProducer producer, size_t pdlen)
+{
+  return doHTTPPOST(apn, 0, 0, url, NULL, producer, pdlen);
+}
+
+bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
+    const char *url, GPRSbeeDataProducer producer, size_t pdlen)
+{
+  return doHTTPPOST(apn, apnuser, apnpwd, url, NULL, producer, pdlen);
+}
+
+bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
+    const char *url, const char *postdata, GPRSbeeDataProducer producer, size_t pdlen)
 {
   bool retval = false;
 
@@ -1663,16 +3105,17 @@ bool GPRSbeeClass::doHTTPPOST(const char *apn, const char *apnuser, const char *
     goto cmd_error;
   }
 
-  if (!doHTTPPOSTmiddle(url, postdata, pdlen)) {
+  if (!doHTTPPOSTmiddle(url, postdata, producer, pdlen)) {
     goto cmd_error;
   }
 
   retval = true;
   doHTTPepilog();
+  _timeToDoHTTP = millis() - _startOn;
   goto ending;
 
 cmd_error:
-  diagPrintLn(F("doHTTPGET failed!"));
+  diagErrorLn(GPRSBEE_DIAG_HTTP, F("doHTTPGET failed!"));
 
 ending:
   off();
@@ -1705,10 +3148,11 @@ bool GPRSbeeClass::doHTTPPOSTWithReply(const char *apn, const char *apnuser, con
 
   retval = true;
   doHTTPepilog();
+  _timeToDoHTTP = millis() - _startOn;
   goto ending;
 
 cmd_error:
-  diagPrintLn(F("doHTTPGET failed!"));
+  diagErrorLn(GPRSBEE_DIAG_HTTP, F("doHTTPGET failed!"));
 
 ending:
   off();
@@ -1744,50 +3188,299 @@ bool GPRSbeeClass::doHTTPGET(const char *apn, const char *apnuser, const char *a
 
   retval = true;
   doHTTPepilog();
+  _timeToDoHTTP = millis() - _startOn;
   goto ending;
 
 cmd_error:
-  diagPrintLn(F("doHTTPGET failed!"));
+  diagErrorLn(GPRSBEE_DIAG_HTTP, F("doHTTPGET failed!"));
 
 ending:
   off();
   return retval;
 }
 
-bool GPRSbeeClass::setBearerParms(const char *apn, const char *user, const char *pwd)
+/*!
+ * \brief Open a HTTP session
+ *
+ * This switches on the modem, opens the bearer and initializes the
+ * HTTP service. After that any number of doHTTPSessionGET and
+ * doHTTPSessionPOST can be done. The session stays open until
+ * closeHTTPSession() is called, or until it is idle for longer than
+ * the linger time (see setHTTPSessionLinger, this needs poll()).
+ *
+ * The APN is remembered (setApn) so that the session can be re-opened
+ * when the bearer drops.
+ */
+bool GPRSbeeClass::openHTTPSession(const char *apn, const char *apnuser, const char *apnpwd)
 {
-  char cmd[64];
-  bool retval = false;
-  int retry;
-
-  // SAPBR=3 Set bearer parameters
-  if (!sendCommandWaitForOK_P(PSTR("AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\""))) {
-    goto ending;
+  setApn(apn, apnuser, apnpwd);
+  _httpSessionOpen = true;
+  _httpSessionLastUse = millis();
+  if (!prepareHTTPSession()) {
+    diagErrorLn(GPRSBEE_DIAG_HTTP, F("openHTTPSession failed!"));
+    closeHTTPSession();
+    return false;
   }
+  return true;
+}
 
-  // SAPBR=3 Set bearer parameters
-  strcpy_P(cmd, PSTR("AT+SAPBR=3,1,\"APN\",\""));
-  strcat(cmd, apn);
-  strcat(cmd, "\"");
-  if (!sendCommandWaitForOK(cmd)) {
-    goto ending;
+/*!
+ * \brief Close the HTTP session
+ */
+void GPRSbeeClass::closeHTTPSession(bool switchOff)
+{
+  _httpSessionOpen = false;
+  if (_httpInitDone) {
+    doHTTPepilog();
   }
-  if (user && user[0]) {
-    strcpy_P(cmd, PSTR("AT+SAPBR=3,1,\"USER\",\""));
-    strcat(cmd, user);
-    strcat(cmd, "\"");
-    if (!sendCommandWaitForOK(cmd)) {
-      goto ending;
+  if (switchOff) {
+    off();
+  } else if (_bearerOpen) {
+    // SAPBR=0 Close bearer
+    sendCommandWaitForOK_P(PSTR("AT+SAPBR=0,1"), 10000);
+    _bearerOpen = false;
+  }
+}
+
+bool GPRSbeeClass::doHTTPSessionGET(const char *url, char *buffer, size_t len)
+{
+  bool retval = false;
+
+  // Not idle anymore, even if the linger time has passed
+  _httpSessionLastUse = millis();
+  if (prepareHTTPSession()) {
+    retval = doHTTPGETmiddle(url, buffer, len);
+    if (!retval && recoverHTTPSession()) {
+      retval = doHTTPGETmiddle(url, buffer, len);
     }
   }
-  if (pwd && pwd[0]) {
-    strcpy_P(cmd, PSTR("AT+SAPBR=3,1,\"PWD\",\""));
-    strcat(cmd, pwd);
-    strcat(cmd, "\"");
-    if (!sendCommandWaitForOK(cmd)) {
-      goto ending;
+  _httpSessionLastUse = millis();
+  return retval;
+}
+
+bool GPRSbeeClass::doHTTPSessionPOST(const char *url, const char *postdata, size_t pdlen)
+{
+  return doHTTPSessionPOST(url, postdata, NULL, pdlen);
+}
+
+bool GPRSbeeClass::doHTTPSessionPOST(const char *url, GPRSbeeDataProducer producer, size_t pdlen)
+{
+  return doHTTPSessionPOST(url, NULL, producer, pdlen);
+}
+
+bool GPRSbeeClass::doHTTPSessionPOST(const char *url, const char *postdata, GPRSbeeDataProducer producer,
+    size_t pdlen)
+{
+  bool retval = false;
+
+  // Not idle anymore, even if the linger time has passed
+  _httpSessionLastUse = millis();
+  if (prepareHTTPSession()) {
+    retval = doHTTPPOSTmiddle(url, postdata, producer, pdlen);
+    if (!retval && producer == NULL && recoverHTTPSession()) {
+      // A producer can't be rewound, so only retry plain data
+      retval = doHTTPPOSTmiddle(url, postdata, producer, pdlen);
+    }
+  }
+  _httpSessionLastUse = millis();
+  return retval;
+}
+
+/*!
+ * \brief Set the storage for the upload queue
+ *
+ * The array is owned by the caller. Any uploads that were queued
+ * before are forgotten.
+ */
+void GPRSbeeClass::setUploadQueue(GPRSbeeUpload *queue, size_t size)
+{
+  _uploadQueue = queue;
+  _uploadQueueSize = size;
+  _uploadCount = 0;
+}
+
+/*!
+ * \brief Add a HTTP POST to the upload queue
+ *
+ * Only the pointers are stored. The URL and the data must stay valid
+ * until the upload succeeded.
+ *
+ * \return false if the queue is full
+ */
+bool GPRSbeeClass::queueUpload(const char *url, const char *data, size_t len)
+{
+  if (_uploadCount >= _uploadQueueSize) {
+    return false;
+  }
+  GPRSbeeUpload & upload = _uploadQueue[_uploadCount++];
+  upload.url = url;
+  upload.data = data;
+  upload.len = len;
+  return true;
+}
+
+/*!
+ * \brief Send all queued uploads with one power-up of the modem
+ *
+ * The outcome of each upload is reported with the (optional) callback.
+ * Failed uploads stay in the queue, in the same order. If the HTTP
+ * session was already open it is left open, otherwise it is closed
+ * (and the modem switched off) when all are done.
+ *
+ * \return the number of successful uploads
+ */
+size_t GPRSbeeClass::flushUploads(const char *apn, const char *apnuser, const char *apnpwd,
+    GPRSbeeUploadCallback callback)
+{
+  if (_uploadCount == 0) {
+    return 0;
+  }
+
+  bool wasOpen = _httpSessionOpen;
+  bool sessionOK = wasOpen || openHTTPSession(apn, apnuser, apnpwd);
+
+  size_t nrDone = 0;
+  size_t nrKept = 0;
+  for (size_t i = 0; i < _uploadCount; ++i) {
+    GPRSbeeUpload upload = _uploadQueue[i];
+    bool success = sessionOK && doHTTPSessionPOST(upload.url, upload.data, upload.len);
+    if (callback) {
+      callback(upload, success);
+    }
+    if (success) {
+      ++nrDone;
+    } else {
+      _uploadQueue[nrKept++] = upload;
+    }
+  }
+  _uploadCount = nrKept;
+
+  if (sessionOK && !wasOpen) {
+    closeHTTPSession();
+  }
+  return nrDone;
+}
+
+/*!
+ * \brief Make sure the bearer and the HTTP service are up
+ */
+bool GPRSbeeClass::prepareHTTPSession()
+{
+  if (!_httpSessionOpen) {
+    return false;
+  }
+
+  if (!_bearerOpen) {
+    if (!on()) {
+      return false;
+    }
+    return doHTTPprolog(_apn, _apnUser, _apnPass);
+  }
+
+  if (!_httpInitDone) {
+    if (!sendCommandWaitForOK_P(PSTR("AT+HTTPINIT"))) {
+      return false;
+    }
+    if (!sendCommandWaitForOK_P(PSTR("AT+HTTPPARA=\"CID\",1"))) {
+      return false;
+    }
+    _httpInitDone = true;
+  }
+
+  return true;
+}
+
+/*!
+ * \brief After a failed request, re-open the session if the bearer dropped
+ *
+ * \return true if the session was re-opened, i.e. it is worth to retry
+ */
+bool GPRSbeeClass::recoverHTTPSession()
+{
+  if (isBearerOpen()) {
+    // The bearer is fine, the request failed for another reason
+    return false;
+  }
+  diagInfoLn(GPRSBEE_DIAG_HTTP, F("Bearer dropped, re-opening"));
+  _bearerOpen = false;
+  if (_httpInitDone) {
+    doHTTPepilog();
+  }
+  return prepareHTTPSession();
+}
+
+/*!
+ * \brief Close the HTTP session if it was not used for the linger time
+ */
+void GPRSbeeClass::checkHTTPSessionLinger()
+{
+  if (_httpSessionOpen && _httpSessionLinger != 0
+      && isTimedOut(_httpSessionLastUse + _httpSessionLinger)) {
+    closeHTTPSession();
+  }
+}
+
+/*!
+ * \brief Ask SIM900 if the bearer is open
+ *
+ * Expect +SAPBR: <cid>,<Status>,<IP_Addr>
+ * <Status> 0 connecting, 1 connected, 2 closing, 3 closed
+ */
+bool GPRSbeeClass::isBearerOpen()
+{
+  char buffer[32];
+  uint32_t ts_max = millis() + 4000;
+  if (!getStrValue_P(PSTR("AT+SAPBR=2,1"), PSTR("+SAPBR:"), buffer, sizeof(buffer), ts_max)) {
+    return false;
+  }
+  GPRSbeeFields fields(buffer, false);
+  int32_t status;
+  if (!fields.skip() || !fields.nextInt(&status) || status != 1) {
+    return false;
+  }
+  fields.nextIP(&_localIP);
+  return true;
+}
+
+/*!
+ * \brief Forget the state of the modem, it was switched off
+ */
+void GPRSbeeClass::resetState()
+{
+  _bearerOpen = false;
+  _localIP = NO_IP_ADDRESS;
+  _httpInitDone = false;
+  resetSockets();
+  _tcpDataPending = false;
+  _tcpRx.clear();
+  _cregStat = 0;
+  _cgregStat = 0;
+  _registrationURC = false;
+  _callReady = false;
+  _identityValid = false;
+}
+
+bool GPRSbeeClass::setBearerParms(const char *apn, const char *user, const char *pwd)
+{
+  uint32_t start = millis();
+  bool retval = false;
+  int retry;
+
+  setEnergyState(EnergyAttaching);
+  // SAPBR=3 Set bearer parameters
+  for (batchBegin(); batchNext(); ) {
+    batchArgs_P(PSTR("+SAPBR="), 3, 1, F("CONTYPE"), F("GPRS"));
+    batchArgs_P(PSTR("+SAPBR="), 3, 1, F("APN"), apn);
+    if (user && user[0]) {
+      batchArgs_P(PSTR("+SAPBR="), 3, 1, F("USER"), user);
+    }
+    if (pwd && pwd[0]) {
+      batchArgs_P(PSTR("+SAPBR="), 3, 1, F("PWD"), pwd);
     }
   }
+  if (!batchOK()) {
+    goto ending;
+  }
 
   // SAPBR=1 Open bearer
   // This command can fail if signal quality is low, or if we're too fast
@@ -1800,23 +3493,42 @@ bool GPRSbeeClass::setBearerParms(const char *apn, const char *user, const char
     goto ending;
   }
 
-  // SAPBR=2 Query bearer
-  // Expect +SAPBR: <cid>,<Status>,<IP_Addr>
-  if (!sendCommandWaitForOK_P(PSTR("AT+SAPBR=2,1"))) {
+  // SAPBR=2 Query bearer, this also gets the IP address
+  if (!isBearerOpen()) {
     goto ending;
   }
 
+  _bearerOpen = true;
   retval = true;
 
 ending:
+  recordPhase(PhaseBearer, start);
+  setEnergyState(EnergyIdle);
   return retval;
 }
 
 bool GPRSbeeClass::getIMEI(char *buffer, size_t buflen)
 {
-  switchEchoOff();
-  uint32_t ts_max = millis() + 2000;
-  return getStrValue("AT+GSN", buffer, buflen, ts_max);
+  if (!readIdentity()) {
+    return false;
+  }
+  return copyIdentityField(_identity.imei, buffer, buflen);
+}
+
+bool GPRSbeeClass::getFirmware(char *buffer, size_t buflen)
+{
+  if (!readIdentity()) {
+    return false;
+  }
+  return copyIdentityField(_identity.firmware, buffer, buflen);
+}
+
+const GPRSbeeIdentity * GPRSbeeClass::getIdentity()
+{
+  if (!readIdentity()) {
+    return NULL;
+  }
+  return &_identity;
 }
 
 bool GPRSbeeClass::getGCAP(char *buffer, size_t buflen)
@@ -1828,16 +3540,18 @@ bool GPRSbeeClass::getGCAP(char *buffer, size_t buflen)
 
 bool GPRSbeeClass::getCIMI(char *buffer, size_t buflen)
 {
-  switchEchoOff();
-  uint32_t ts_max = millis() + 2000;
-  return getStrValue("AT+CIMI", buffer, buflen, ts_max);
+  if (!readIdentity()) {
+    return false;
+  }
+  return copyIdentityField(_identity.imsi, buffer, buflen);
 }
 
 bool GPRSbeeClass::getCCID(char *buffer, size_t buflen)
 {
-  switchEchoOff();
-  uint32_t ts_max = millis() + 2000;
-  return getStrValue("AT+CCID", buffer, buflen, ts_max);
+  if (!readIdentity()) {
+    return false;
+  }
+  return copyIdentityField(_identity.ccid, buffer, buflen);
 }
 
 bool GPRSbeeClass::getCLIP(char *buffer, size_t buflen)
@@ -1874,11 +3588,7 @@ bool GPRSbeeClass::setCCLK(const SIMDateTime & dt)
   str.reserve(30);
   dt.addToString(str);
   switchEchoOff();
-  sendCommandProlog();
-  sendCommandAdd_P(PSTR("AT+CCLK=\""));
-  sendCommandAdd(str);
-  sendCommandAdd('"');
-  sendCommandEpilog();
+  sendCommandArgs_P(PSTR("AT+CCLK="), str.c_str());
   return waitForOK();
 }
 
@@ -1986,24 +3696,89 @@ void GPRSbeeClass::disableCIURC()
  */
 bool GPRSbeeClass::getPII(char *buffer, size_t buflen)
 {
-  switchEchoOff();
-  uint32_t ts_max = millis() + 2000;
-  return getStrValue("ATI", buffer, buflen, ts_max);
+  if (!readIdentity()) {
+    return false;
+  }
+  return copyIdentityField(_identity.pii, buffer, buflen);
 }
 
 void GPRSbeeClass::setProductId()
 {
-  char buffer[64];
-  if (getPII(buffer, sizeof(buffer))) {
-    if (strncmp_P(buffer, PSTR("SIM900"), 6) == 0) {
+  if (readIdentity()) {
+    if (strncmp_P(_identity.pii, PSTR("SIM900"), 6) == 0) {
       _productId = prodid_SIM900;
     }
-    else if (strncmp_P(buffer, PSTR("SIM800"), 6) == 0) {
+    else if (strncmp_P(_identity.pii, PSTR("SIM800"), 6) == 0) {
       _productId = prodid_SIM800;
     }
   }
 }
 
+/*!
+ * \brief Read the identity of the modem and the SIM, once per power cycle
+ *
+ * If there is a stored identity (see setIdentityStore) only the IMEI is
+ * asked. When it is the same as the stored one the rest is not asked
+ * for. Note that this assumes that the SIM is not swapped.
+ */
+bool GPRSbeeClass::readIdentity()
+{
+  if (_identityValid) {
+    return true;
+  }
+  if (!isOn()) {
+    return false;
+  }
+
+  switchEchoOff();
+  uint32_t ts_max = millis() + 2000;
+  char imei[sizeof(_identity.imei)];
+  if (!getStrValue("AT+GSN", imei, sizeof(imei), ts_max)) {
+    return false;
+  }
+
+  if (_identityLoad && _identityLoad(_identity) && strcmp(_identity.imei, imei) == 0) {
+    _identityValid = true;
+    return true;
+  }
+
+  memset(&_identity, 0, sizeof(_identity));
+  strcpy(_identity.imei, imei);
+  ts_max = millis() + 2000;
+  if (!getStrValue("ATI", _identity.pii, sizeof(_identity.pii), ts_max)) {
+    return false;
+  }
+  // The others are not fatal, e.g. there is no SIM
+  ts_max = millis() + 2000;
+  if (!getStrValue("AT+GMR", _identity.firmware, sizeof(_identity.firmware), ts_max)) {
+    _identity.firmware[0] = '\0';
+  }
+  ts_max = millis() + 2000;
+  if (!getStrValue("AT+CCID", _identity.ccid, sizeof(_identity.ccid), ts_max)) {
+    _identity.ccid[0] = '\0';
+  }
+  ts_max = millis() + 2000;
+  if (!getStrValue("AT+CIMI", _identity.imsi, sizeof(_identity.imsi), ts_max)) {
+    _identity.imsi[0] = '\0';
+  }
+
+  _identityValid = true;
+  if (_identitySave) {
+    _identitySave(_identity);
+  }
+  return true;
+}
+
+bool GPRSbeeClass::copyIdentityField(const char *field, char *buffer, size_t buflen)
+{
+  if (*field == '\0' || buflen == 0) {
+    return false;
+  }
+  strncpy(buffer, field, buflen - 1);
+  buffer[buflen - 1] = '\0';
+  return true;
+}
+
 const char * GPRSbeeClass::skipWhiteSpace(const char * txt)
 {
   while (*txt != '\0' && *txt == ' ') {
@@ -2282,6 +4057,585 @@ void SIMDateTime::addToString(String & str) const
   str += "+00";
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    Sockets            /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The sockets use the multi connection mode of SIM900 (AT+CIPMUX=1).
+ * The first socket that is created brings up the PDP context. It stays
+ * up when sockets are closed, until the modem is switched off or until
+ * the single connection openTCP is used.
+ *
+ * Received data stays in SIM900 (AT+CIPRXGET=1). It tells us with
+ *   +CIPRXGET: 1,<n>
+ * that there is new data for a socket, and socketReceive fetches it with
+ * AT+CIPRXGET=2,<n>,<len> straight into the buffer of the caller. So
+ * nothing is lost, however big the TCP segments are.
+ */
+
+/*!
+ * \brief Create a socket
+ *
+ * \return the socket number, or SOCKET_FAIL
+ */
+int GPRSbeeClass::createSocket(Protocols protocol, uint16_t localPort)
+{
+  uint8_t socket;
+  for (socket = 0; socket < GPRSBEE_MAX_SOCKETS; ++socket) {
+    if (!_sockets[socket].inUse) {
+      break;
+    }
+  }
+  if (socket >= GPRSBEE_MAX_SOCKETS) {
+    return SOCKET_FAIL;
+  }
+
+  if (!_muxOpen && !openMUX()) {
+    return SOCKET_FAIL;
+  }
+
+  GPRSbeeSocket & sock = _sockets[socket];
+  sock.inUse = true;
+  sock.connected = false;
+  sock.dataPending = false;
+  sock.protocol = protocol;
+  sock.localPort = localPort;
+
+  return socket;
+}
+
+bool GPRSbeeClass::connectSocket(uint8_t socket, const char* host, uint16_t port)
+{
+  if (socket >= GPRSBEE_MAX_SOCKETS || !_sockets[socket].inUse) {
+    return false;
+  }
+  GPRSbeeSocket & sock = _sockets[socket];
+  const char * reply;
+
+  if (sock.localPort != 0) {
+    // AT+CLPORT=<n>,"TCP",<port>
+    sendCommandArgs_P(PSTR("AT+CLPORT="), socket, sock.protocol == UDP ? F("UDP") : F("TCP"), sock.localPort);
+    if (!waitForOK()) {
+      return false;
+    }
+  }
+
+  // AT+CIPSTART=<n>,"TCP","server",8500
+  sendCommandArgs_P(PSTR("AT+CIPSTART="), socket, sock.protocol == UDP ? F("UDP") : F("TCP"), host, port);
+  if (!waitForOK()) {
+    return false;
+  }
+
+  // <n>, CONNECT OK
+  reply = waitForSocketReply(socket, millis() + 15000);
+  if (reply == NULL) {
+    return false;
+  }
+  if (strcmp_P(reply, PSTR("CONNECT OK")) != 0 && strcmp_P(reply, PSTR("ALREADY CONNECT")) != 0) {
+    return false;
+  }
+
+  sock.connected = true;
+  return true;
+}
+
+bool GPRSbeeClass::socketSend(uint8_t socket, const uint8_t* buffer, size_t size)
+{
+  if (socket >= GPRSBEE_MAX_SOCKETS || !_sockets[socket].connected) {
+    return false;
+  }
+  uint32_t ts_max;
+  const char * reply;
+  bool retval = true;
+
+  setEnergyState(EnergyTransmitting);
+  while (size > 0) {
+    size_t my_size = size;
+    if (my_size > GPRSBEE_MAX_SEND_SIZE) {
+      my_size = GPRSBEE_MAX_SEND_SIZE;
+    }
+
+    // AT+CIPSEND=<n>,<length>
+    sendCommandProlog();
+    sendCommandAdd_P(PSTR("AT+CIPSEND="));
+    sendCommandAdd((int)socket);
+    sendCommandAdd(',');
+    sendCommandAdd((int)my_size);
+    sendCommandEpilog();
+    ts_max = millis() + 4000;
+    if (!waitForPrompt("> ", ts_max)) {
+      retval = false;
+      break;
+    }
+    writeData(buffer, my_size);
+
+    // <n>, SEND OK
+    reply = waitForSocketReply(socket, millis() + 10000);
+    if (reply == NULL || strcmp_P(reply, PSTR("SEND OK")) != 0) {
+      retval = false;
+      break;
+    }
+    buffer += my_size;
+    size -= my_size;
+  }
+
+  setEnergyState(EnergyIdle);
+  return retval;
+}
+
+/*!
+ * \brief Get the received data of a socket
+ *
+ * This does not wait for new data. It picks up the input that SIM900 has
+ * sent so far, and if SIM900 has data for the socket it fetches at most
+ * size bytes of it.
+ *
+ * \return the number of bytes copied in the buffer
+ */
+size_t GPRSbeeClass::socketReceive(uint8_t socket, uint8_t* buffer, size_t size)
+{
+  if (socket >= GPRSBEE_MAX_SOCKETS || !_sockets[socket].inUse || size == 0) {
+    return 0;
+  }
+
+  // Handle the pending input, "+CIPRXGET: 1,<n>" sets dataPending
+  while (pollLine() >= 0) {
+  }
+
+  if (!_sockets[socket].dataPending) {
+    return 0;
+  }
+  return fetchSocketData(socket, buffer, size);
+}
+
+bool GPRSbeeClass::closeSocket(uint8_t socket)
+{
+  if (socket >= GPRSBEE_MAX_SOCKETS || !_sockets[socket].inUse) {
+    return false;
+  }
+  GPRSbeeSocket & sock = _sockets[socket];
+  bool retval = true;
+
+  if (sock.connected) {
+    // AT+CIPCLOSE=<n>
+    sendCommandProlog();
+    sendCommandAdd_P(PSTR("AT+CIPCLOSE="));
+    sendCommandAdd((int)socket);
+    sendCommandEpilog();
+
+    // <n>, CLOSE OK
+    const char * reply = waitForSocketReply(socket, millis() + 4000);
+    retval = reply != NULL && strcmp_P(reply, PSTR("CLOSE OK")) == 0;
+  }
+
+  sock.inUse = false;
+  sock.connected = false;
+  sock.dataPending = false;
+  return retval;
+}
+
+bool GPRSbeeClass::isSocketConnected(uint8_t socket)
+{
+  if (socket >= GPRSBEE_MAX_SOCKETS) {
+    return false;
+  }
+  // Pick up CLOSED messages
+  while (pollLine() >= 0) {
+  }
+  return _sockets[socket].connected;
+}
+
+/*!
+ * \brief Bring up the PDP context in multi connection mode
+ */
+bool GPRSbeeClass::openMUX()
+{
+  uint32_t ts_max;
+  int len;
+  bool retval = false;
+
+  if (!on()) {
+    return false;
+  }
+
+  if (!connectProlog()) {
+    return false;
+  }
+
+  sendCommand_P(PSTR("AT+CIPSHUT"));
+  if (!waitForMessage_P(PSTR("SHUT OK"), millis() + 4000)) {
+    return false;
+  }
+
+  if (!sendCommandWaitForOK_P(PSTR("AT+CIPMUX=1"))) {
+    return false;
+  }
+  // Let SIM900 keep the received data until we ask for it
+  if (!sendCommandWaitForOK_P(PSTR("AT+CIPRXGET=1"))) {
+    return false;
+  }
+
+  setEnergyState(EnergyAttaching);
+  // AT+CSTT=<apn>,<username>,<password>
+  sendCommandArgs_P(PSTR("AT+CSTT="), _apn, _apnUser, _apnPass);
+  if (!waitForOK()) {
+    goto ending;
+  }
+
+  if (!sendCommandWaitForOK_P(PSTR("AT+CIICR"), 30000)) {
+    goto ending;
+  }
+
+  // Get local IP address. The reply is just the IP address, without OK.
+  sendCommand_P(PSTR("AT+CIFSR"));
+  ts_max = millis() + 4000;
+  while ((len = readLine(ts_max)) == 0) {
+  }
+  if (len < 0) {
+    goto ending;
+  }
+  if (!GPRSbeeFields(_inputBuffer, false).nextIP(&_localIP)) {
+    // ERROR
+    goto ending;
+  }
+
+  _muxOpen = true;
+  retval = true;
+
+ending:
+  // Also when it failed, the modem is not attaching anymore
+  setEnergyState(EnergyIdle);
+  return retval;
+}
+
+/*!
+ * \brief Forget all sockets, e.g. after leaving the multi connection mode
+ */
+void GPRSbeeClass::resetSockets()
+{
+  _muxOpen = false;
+  for (uint8_t socket = 0; socket < GPRSBEE_MAX_SOCKETS; ++socket) {
+    _sockets[socket].inUse = false;
+    _sockets[socket].connected = false;
+    _sockets[socket].dataPending = false;
+  }
+}
+
+/*!
+ * \brief Wait for a line "<n>, <reply>" for a socket
+ *
+ * \return a pointer to the <reply> part in the input buffer, or NULL
+ *   if it timed out
+ */
+const char * GPRSbeeClass::waitForSocketReply(uint8_t socket, uint32_t ts_max)
+{
+  int len;
+  while ((len = readLine(ts_max)) >= 0) {
+    if (len > 3 && _inputBuffer[0] == '0' + socket && _inputBuffer[1] == ',') {
+      return skipWhiteSpace(_inputBuffer + 2);
+    }
+    if (strcmp_P(_inputBuffer, PSTR("ERROR")) == 0) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * \brief Fetch received data of a socket from SIM900
+ *
+ * Expected reply:
+ *   +CIPRXGET: 2,<n>,<reqlength>,<cnflength>
+ *   <data>
+ *   OK
+ * <cnflength> is what is still left in SIM900
+ *
+ * \return the number of bytes copied in the buffer
+ */
+size_t GPRSbeeClass::fetchSocketData(uint8_t socket, uint8_t *buffer, size_t size)
+{
+  uint32_t ts_max;
+
+  if (size > 1460) {
+    // The maximum <reqlength>
+    size = 1460;
+  }
+  sendCommandArgs_P(PSTR("AT+CIPRXGET=2,"), socket, size);
+  ts_max = millis() + 4000;
+  if (!waitForRxGetReply(ts_max)) {
+    return 0;
+  }
+  GPRSbeeFields fields(_inputBuffer);
+  int32_t value = 0;
+  int32_t cnfLength = 0;
+  fields.skip(2);
+  if (!fields.nextInt(&value) || value < 0) {
+    // We don't know how much data follows, skip everything up to the OK
+    waitForOK();
+    return 0;
+  }
+  if ((size_t)value > size) {
+    // More than we asked for. Drop it all, the data must not be taken for
+    // the next reply.
+    readBytes(value, buffer, 0, millis() + 1000);
+    waitForOK();
+    return 0;
+  }
+  size_t len = value;
+  _sockets[socket].dataPending = fields.nextInt(&cnfLength) && cnfLength > 0;
+
+  ts_max = millis() + 1000;
+  if (readBytes(len, buffer, len, ts_max) != 0) {
+    return 0;
+  }
+  if (!waitForOK()) {
+    return 0;
+  }
+  return len;
+}
+
+/*!
+ * \brief Handle the lines of SIM900 that are about the sockets
+ *
+ * This is called for each line read by pollLine.
+ *
+ * \return true if the line was consumed
+ */
+bool GPRSbeeClass::handleSocketLine()
+{
+  // <n>, CLOSED
+  if (_inputBuffer[0] >= '0' && _inputBuffer[0] < '0' + GPRSBEE_MAX_SOCKETS && _inputBuffer[1] == ','
+      && strcmp_P(skipWhiteSpace(_inputBuffer + 2), PSTR("CLOSED")) == 0) {
+    _sockets[_inputBuffer[0] - '0'].connected = false;
+    // Don't consume the line, someone may be waiting for it.
+  }
+
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    Trace              /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief Keep a trace of the AT commands and the replies
+ *
+ * Each line is stored with a timestamp (millis) in the buffer. When the
+ * buffer is full the oldest lines are dropped. Use dumpTrace to print it,
+ * extras/gprsbee_trace.py can show it with the latency of each command.
+ *
+ * When the trace is used the replies are no longer echoed to the diag
+ * stream.
+ */
+void GPRSbeeClass::setTrace(uint8_t *buffer, size_t size)
+{
+  _traceBuffer = buffer;
+  _traceSize = size;
+  clearTrace();
+}
+
+void GPRSbeeClass::clearTrace()
+{
+  _traceTail = 0;
+  _traceUsed = 0;
+  _traceOpen = false;
+}
+
+/*
+ * \brief Add one byte to the trace, drop the oldest record if needed
+ *
+ * \return false if the byte did not fit
+ */
+bool GPRSbeeClass::tracePut(uint8_t c)
+{
+  if (_traceUsed >= _traceSize) {
+    if (_traceOpen && _traceRecord == _traceTail) {
+      // The record we're adding to fills the whole buffer
+      return false;
+    }
+    size_t len = 6 + traceGet(_traceTail + 5);
+    _traceTail = (_traceTail + len) % _traceSize;
+    _traceUsed -= len;
+  }
+  _traceBuffer[(_traceTail + _traceUsed) % _traceSize] = c;
+  ++_traceUsed;
+  return true;
+}
+
+void GPRSbeeClass::traceBegin(char type)
+{
+  if (_traceBuffer == NULL || _traceSize < 6 + GPRSBEE_TRACE_LINE_SIZE) {
+    return;
+  }
+  uint32_t ts = millis();
+  _traceOpen = false;           // A record that was not ended stays as it is
+  _traceRecord = (_traceTail + _traceUsed) % _traceSize;
+  tracePut(type);
+  _traceOpen = true;
+  for (uint8_t i = 0; i < 4; ++i) {
+    tracePut(ts & 0xFF);
+    ts >>= 8;
+  }
+  tracePut(0);                  // The length
+}
+
+void GPRSbeeClass::traceAdd(const char *data, size_t len)
+{
+  if (!_traceOpen) {
+    return;
+  }
+  size_t lenPos = (_traceRecord + 5) % _traceSize;
+  while (len-- > 0 && _traceBuffer[lenPos] < GPRSBEE_TRACE_LINE_SIZE) {
+    if (!tracePut(*data++)) {
+      break;
+    }
+    ++_traceBuffer[lenPos];
+  }
+}
+
+void GPRSbeeClass::traceAdd_P(const char *data)
+{
+  char c;
+  while (_traceOpen && (c = pgm_read_byte(data++)) != '\0') {
+    traceAdd(&c, 1);
+  }
+}
+
+void GPRSbeeClass::traceEnd()
+{
+  if (!_traceOpen) {
+    return;
+  }
+  _traceOpen = false;
+  if (_traceCallback) {
+    char type;
+    uint32_t ts;
+    char line[GPRSBEE_TRACE_LINE_SIZE];
+    size_t len;
+    traceRead(_traceRecord, &type, &ts, line, &len);
+    _traceCallback(type, ts, line, len);
+  }
+}
+
+/*
+ * \brief Get the record at pos from the trace
+ *
+ * \return the position of the next record
+ */
+size_t GPRSbeeClass::traceRead(size_t pos, char *type, uint32_t *ts, char *line, size_t *len) const
+{
+  *type = traceGet(pos);
+  *ts = 0;
+  for (uint8_t i = 4; i > 0; --i) {
+    *ts = (*ts << 8) | traceGet(pos + i);
+  }
+  *len = traceGet(pos + 5);
+  for (size_t i = 0; i < *len; ++i) {
+    line[i] = traceGet(pos + 6 + i);
+  }
+  return pos + 6 + *len;
+}
+
+/*!
+ * \brief Print the trace, one line per record
+ *
+ * The format is "<type> <ms> <line>", with 'T' for the commands
+ * to the modem and 'R' for the replies. For example
+ *   T 10230 AT+CSQ
+ *   R 10262 +CSQ: 18,0
+ */
+void GPRSbeeClass::dumpTrace(Stream & stream)
+{
+  size_t pos = _traceTail;
+  size_t end = _traceTail + _traceUsed;
+  if (_traceOpen) {
+    // Leave out the record that isn't complete yet
+    end = _traceTail + ((_traceRecord + _traceSize - _traceTail) % _traceSize);
+  }
+  while (pos < end) {
+    char type;
+    uint32_t ts;
+    char line[GPRSBEE_TRACE_LINE_SIZE];
+    size_t len;
+    pos = traceRead(pos, &type, &ts, line, &len);
+    stream.print(type);
+    stream.print(' ');
+    stream.print(ts);
+    stream.print(' ');
+    stream.write((const uint8_t *)line, len);
+    stream.println();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    GPRSbeeRingBuffer  /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void GPRSbeeRingBuffer::init(uint8_t *buffer, size_t size)
+{
+  _buffer = buffer;
+  _size = size;
+  clear();
+}
+
+bool GPRSbeeRingBuffer::put(uint8_t c)
+{
+  if (_count >= _size) {
+    return false;
+  }
+  size_t ix = _head + _count;
+  if (ix >= _size) {
+    ix -= _size;
+  }
+  _buffer[ix] = c;
+  ++_count;
+  return true;
+}
+
+int GPRSbeeRingBuffer::get()
+{
+  if (_count == 0) {
+    return -1;
+  }
+  uint8_t c = _buffer[_head];
+  if (++_head >= _size) {
+    _head = 0;
+  }
+  --_count;
+  return c;
+}
+
+size_t GPRSbeeRingBuffer::read(uint8_t *buffer, size_t len)
+{
+  size_t n = 0;
+  while (n < len && _count > 0) {
+    buffer[n++] = get();
+  }
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    GPRSbeeCommand     /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+GPRSbeeCommand::GPRSbeeCommand(const char *cmd, uint32_t timeout, const char *reply,
+    char *replyBuffer, size_t replyBufferSize, GPRSbeeCommandCallback callback)
+{
+  this->cmd = cmd;
+  this->inProgmem = false;
+  this->reply = reply;
+  this->replyBuffer = replyBuffer;
+  this->replyBufferSize = replyBufferSize;
+  this->timeout = timeout;
+  this->callback = callback;
+  state = CommandIdle;
+  _ts_max = 0;
+  _seenOK = false;
+  _seenReply = false;
+  _next = NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////    MQTT               /////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,10 +27,6 @@
 
 #include "Sodaq_GSM_Modem.h"
 
-// Comment this line, or make it an undef to disable
-// diagnostic
-#define ENABLE_GPRSBEE_DIAG     1
-
 /*!
  * \def SIM900_DEFAULT_BUFFER_SIZE
  *
@@ -50,6 +46,142 @@
  */
 #define SIM900_DEFAULT_BUFFER_SIZE      64
 
+/*!
+ * \def GPRSBEE_LINE_IDLE_MS
+ *
+ * Before sending a command we wait until the SIMx00 has not sent anything
+ * for this number of milliseconds. Anything that comes in (the tail of a
+ * previous reply, an URC) is discarded. This is a few character times at
+ * the lowest baud rate that is normally used.
+ */
+#ifndef GPRSBEE_LINE_IDLE_MS
+#define GPRSBEE_LINE_IDLE_MS            5
+#endif
+
+/*!
+ * \def GPRSBEE_DEFAULT_BAUDRATE
+ *
+ * The baud rate that the modem stream should be opened with. Out of the
+ * box the SIMx00 detects the baud rate (autobauding) from the first "AT".
+ */
+#ifndef GPRSBEE_DEFAULT_BAUDRATE
+#define GPRSBEE_DEFAULT_BAUDRATE        19200
+#endif
+
+/*!
+ * \def GPRSBEE_PROBE_MS
+ *
+ * How long to wait for the OK of one "AT" while probing the baud rate (see
+ * setBaudrateProbe). A reply at 9600 baud takes about 10 ms.
+ */
+#ifndef GPRSBEE_PROBE_MS
+#define GPRSBEE_PROBE_MS                300
+#endif
+
+/*!
+ * \def GPRSBEE_TX_CHUNK_SIZE
+ *
+ * Payload data (TCP, FTP, HTTP POST) is written to the modem stream in
+ * blocks of at most this size. Match it with the TX buffer of the UART.
+ */
+#ifndef GPRSBEE_TX_CHUNK_SIZE
+#define GPRSBEE_TX_CHUNK_SIZE           64
+#endif
+
+/*!
+ * \def GPRSBEE_RX_PIECE_SIZE
+ *
+ * When received data is passed on (e.g. the chunked doHTTPREAD) it is
+ * collected in a small buffer on the stack of this size.
+ */
+#ifndef GPRSBEE_RX_PIECE_SIZE
+#define GPRSBEE_RX_PIECE_SIZE           16
+#endif
+
+/*!
+ * \def GPRSBEE_MAX_SOCKETS
+ *
+ * The number of sockets (createSocket). SIM800 and SIM900 can handle
+ * up to 6 connections at the same time (AT+CIPMUX=1).
+ *
+ * \def GPRSBEE_MAX_SEND_SIZE
+ *
+ * The maximum length of one AT+CIPSEND. Longer data is split up.
+ */
+#ifndef GPRSBEE_MAX_SOCKETS
+#define GPRSBEE_MAX_SOCKETS             6
+#endif
+#ifndef GPRSBEE_MAX_SEND_SIZE
+#define GPRSBEE_MAX_SEND_SIZE           1024
+#endif
+
+/*!
+ * \def GPRSBEE_TCP_RX_BUFFER_SIZE
+ *
+ * The size of the receive buffer for openTCP when AT+CIPRXGET is used
+ * (see setTCPRxGet). It is allocated the first time it is needed.
+ */
+#ifndef GPRSBEE_TCP_RX_BUFFER_SIZE
+#define GPRSBEE_TCP_RX_BUFFER_SIZE      64
+#endif
+
+/*!
+ * \def GPRSBEE_CREG_CHECK_INTERVAL
+ *
+ * While waiting for the registration (+CREG: URC), ask for the status
+ * anyway when nothing came in for this many ms.
+ */
+#ifndef GPRSBEE_CREG_CHECK_INTERVAL
+#define GPRSBEE_CREG_CHECK_INTERVAL     10000
+#endif
+
+/*!
+ * \def GPRSBEE_TRACE_LINE_SIZE
+ *
+ * The maximum length of a line in the trace. Longer lines are cut off.
+ */
+#ifndef GPRSBEE_TRACE_LINE_SIZE
+#define GPRSBEE_TRACE_LINE_SIZE         64
+#endif
+
+/*!
+ * \def GPRSBEE_CSQ_HISTORY
+ *
+ * The number of RSSI values that waitForSignalQuality remembers.
+ *
+ * \def GPRSBEE_CSQ_ABORT_TIME
+ *
+ * After this many ms waitForSignalQuality may give up early. That
+ * happens when the best RSSI is more than GPRSBEE_CSQ_ABORT_MARGIN dB
+ * below the minimum and the signal is not going up. (Right after
+ * switching on SIM900 reports "no signal" for a few seconds.)
+ *
+ * \def GPRSBEE_CSQ_GOOD_MARGIN
+ *
+ * An RSSI this many dB above the minimum is considered good.
+ *
+ * \def GPRSBEE_CSQ_SKIP_TIME
+ *
+ * waitForSignalQuality is skipped if a good signal was seen less than
+ * this many ms ago (see setSignalQualitySkipTime). Note that millis()
+ * does not count while the MCU sleeps.
+ */
+#ifndef GPRSBEE_CSQ_HISTORY
+#define GPRSBEE_CSQ_HISTORY             8
+#endif
+#ifndef GPRSBEE_CSQ_ABORT_TIME
+#define GPRSBEE_CSQ_ABORT_TIME          10000
+#endif
+#ifndef GPRSBEE_CSQ_ABORT_MARGIN
+#define GPRSBEE_CSQ_ABORT_MARGIN        10
+#endif
+#ifndef GPRSBEE_CSQ_GOOD_MARGIN
+#define GPRSBEE_CSQ_GOOD_MARGIN         10
+#endif
+#ifndef GPRSBEE_CSQ_SKIP_TIME
+#define GPRSBEE_CSQ_SKIP_TIME           60000
+#endif
+
 /*
  * \brief A class to store clock values
  */
@@ -97,6 +229,136 @@ private:
   int8_t        _tz;            // timezone (multiple of 15 minutes)
 };
 
+/*
+ * \brief The states of a GPRSbeeCommand
+ */
+enum GPRSbeeCommandStates {
+  CommandIdle = 0,
+  CommandQueued,
+  CommandBusy,
+  CommandOK,
+  CommandError,
+  CommandTimeout,
+};
+
+typedef void (*GPRSbeeDataCallback)(const uint8_t *data, size_t len);
+// Fill the buffer with at most size bytes, return the number of bytes
+typedef size_t (*GPRSbeeDataProducer)(uint8_t *buffer, size_t size);
+
+/*
+ * \brief A simple FIFO of bytes, the storage is provided by the owner
+ */
+class GPRSbeeRingBuffer
+{
+public:
+  GPRSbeeRingBuffer() : _buffer(0), _size(0), _head(0), _count(0) {}
+  void init(uint8_t *buffer, size_t size);
+  void clear() { _head = 0; _count = 0; }
+  size_t available() const { return _count; }
+  size_t space() const { return _size - _count; }
+  bool put(uint8_t c);
+  int get();
+  size_t read(uint8_t *buffer, size_t len);
+
+private:
+  uint8_t *     _buffer;
+  size_t        _size;
+  size_t        _head;
+  size_t        _count;
+};
+
+class GPRSbeeCommand;
+typedef void (*GPRSbeeCommandCallback)(GPRSbeeCommand & cmd);
+
+/*
+ * \brief An AT command for the non-blocking command queue
+ *
+ * The object is owned by the caller. It is handed to queueCommand() and
+ * it must stay alive until it is done. Its state tells the progress, and
+ * the optional callback is called when it is done (OK, ERROR or timeout).
+ *
+ * A command is OK when the "OK" is seen and, if a reply prefix is given,
+ * the reply is seen. The order does not matter, so this works both for
+ * AT+CSQ (reply first) and AT+HTTPACTION (OK first, reply much later).
+ */
+class GPRSbeeCommand
+{
+public:
+  GPRSbeeCommand(const char *cmd=NULL, uint32_t timeout=4000, const char *reply=NULL,
+      char *replyBuffer=NULL, size_t replyBufferSize=0, GPRSbeeCommandCallback callback=NULL);
+
+  bool isDone() const { return state >= CommandOK; }
+  bool isOK() const { return state == CommandOK; }
+
+  const char *  cmd;            // The command, without the <CR>
+  bool          inProgmem;      // cmd and reply are in PROGMEM (set by queueCommand_P)
+  const char *  reply;          // Optional prefix of the reply, e.g. "+HTTPACTION:"
+  char *        replyBuffer;    // Optional buffer for the text after the reply prefix
+  size_t        replyBufferSize;
+  uint32_t      timeout;        // Maximum number of ms after sending the command
+  GPRSbeeCommandCallback callback;
+  GPRSbeeCommandStates state;
+
+private:
+  friend class GPRSbeeClass;
+  uint32_t      _ts_max;
+  bool          _seenOK;
+  bool          _seenReply;
+  GPRSbeeCommand * _next;
+};
+
+/*
+ * \brief A HTTP POST in the upload queue
+ */
+struct GPRSbeeUpload
+{
+  const char *  url;
+  const char *  data;
+  size_t        len;
+};
+
+typedef void (*GPRSbeeUploadCallback)(const GPRSbeeUpload & upload, bool success);
+
+/*
+ * \brief The identity of the modem and the SIM
+ *
+ * This is filled once after the modem is switched on. All strings are
+ * NUL terminated, an empty string means it is not known.
+ */
+struct GPRSbeeIdentity
+{
+  char          pii[24];        // ATI, e.g. "SIM800 R14.18"
+  char          firmware[32];   // AT+GMR
+  char          imei[16];       // AT+GSN
+  char          ccid[22];       // AT+CCID
+  char          imsi[16];       // AT+CIMI
+};
+
+/*!
+ * \brief Load a stored identity, return false if there is none
+ */
+typedef bool (*GPRSbeeIdentityLoad)(GPRSbeeIdentity & identity);
+/*!
+ * \brief Store the identity, e.g. in EEPROM. The IMEI is the key.
+ */
+typedef void (*GPRSbeeIdentitySave)(const GPRSbeeIdentity & identity);
+
+/*!
+ * \brief Called for each line in the trace
+ *
+ * The type is 'T' for a command sent to the modem and 'R' for a line
+ * received from the modem. The line is not NUL terminated.
+ */
+typedef void (*GPRSbeeTraceCallback)(char type, uint32_t ts, const char *line, size_t len);
+
+/*!
+ * \brief Called for each unsolicited result code (URC) that is recognized
+ *
+ * The line is the complete URC, e.g. "+CMTI: \"SM\",3". It is called after
+ * the library has updated its own state.
+ */
+typedef void (*GPRSbeeURCCallback)(const char *line);
+
 class GPRSbeeClass : public Sodaq_GSM_Modem
 {
 public:
@@ -113,7 +375,11 @@ public:
   bool doHTTPPOST(const char *apn, const String & url, const char *postdata, size_t pdlen);
   bool doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
       const char *url, const char *postdata, size_t pdlen);
+  bool doHTTPPOST(const char *apn, const char *url, GPRSbeeDataProducer producer, size_t pdlen);
+  bool doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
+      const char *url, GPRSbeeDataProducer producer, size_t pdlen);
   bool doHTTPPOSTmiddle(const char *url, const char *postdata, size_t pdlen);
+  bool doHTTPPOSTmiddle(const char *url, GPRSbeeDataProducer producer, size_t pdlen);
   bool doHTTPPOSTmiddleWithReply(const char *url, const char *postdata, size_t pdlen, char *buffer, size_t len);
 
   bool doHTTPPOSTWithReply(const char *apn, const char *url, const char *postdata, size_t pdlen, char *buffer, size_t len);
@@ -128,12 +394,38 @@ public:
   bool doHTTPGETmiddle(const char *url, char *buffer, size_t len);
 
   bool doHTTPREAD(char *buffer, size_t len);
+  bool doHTTPREAD(Print & sink, size_t chunkSize=64);
+  bool doHTTPREAD(GPRSbeeDataCallback callback, size_t chunkSize=64);
   bool doHTTPACTION(char num);
 
   bool doHTTPprolog(const char *apn);
   bool doHTTPprolog(const char *apn, const char *apnuser, const char *apnpwd);
   void doHTTPepilog();
 
+  // HTTP session, the bearer and HTTP service stay open between requests
+  bool openHTTPSession(const char *apn, const char *apnuser=NULL, const char *apnpwd=NULL);
+  void closeHTTPSession(bool switchOff=true);
+  bool isHTTPSessionOpen() const { return _httpSessionOpen; }
+  // Close the session automatically after it is idle for this many ms (0 is never)
+  void setHTTPSessionLinger(uint32_t ms) { _httpSessionLinger = ms; }
+  bool doHTTPSessionGET(const char *url, char *buffer, size_t len);
+  bool doHTTPSessionPOST(const char *url, const char *postdata, size_t pdlen);
+  bool doHTTPSessionPOST(const char *url, GPRSbeeDataProducer producer, size_t pdlen);
+
+  // Trace of the AT commands and replies, kept in a ring buffer. When it
+  // is used the replies are no longer echoed to the diag stream.
+  void setTrace(uint8_t *buffer, size_t size);
+  void setTraceCallback(GPRSbeeTraceCallback callback) { _traceCallback = callback; }
+  void clearTrace();
+  void dumpTrace(Stream & stream);
+
+  // Upload queue, all queued POSTs are sent with one power-up of the modem
+  void setUploadQueue(GPRSbeeUpload *queue, size_t size);
+  bool queueUpload(const char *url, const char *data, size_t len);
+  size_t getUploadCount() const { return _uploadCount; }
+  size_t flushUploads(const char *apn, const char *apnuser=NULL, const char *apnpwd=NULL,
+      GPRSbeeUploadCallback callback=NULL);
+
   bool openTCP(const char *apn, const char *server, int port, bool transMode=false);
   bool openTCP(const char *apn, const char *apnuser, const char *apnpwd,
       const char *server, int port, bool transMode=false);
@@ -142,6 +434,32 @@ public:
   bool sendDataTCP(const uint8_t *data, size_t data_len);
   bool receiveDataTCP(uint8_t *data, size_t data_len, uint16_t timeout=4000);
   bool receiveLineTCP(const char **buffer, uint16_t timeout=4000);
+  // Has the modem said "CLOSED" after openTCP?
+  bool isTCPClosed() const { return _tcpClosed; }
+
+  // Unsolicited result codes (URC)
+  void setURCCallback(GPRSbeeURCCallback callback) { _urcCallback = callback; }
+  // The <stat> of the last +CREG: (1 is registered, 5 is roaming)
+  uint8_t getCREGStat() const { return _cregStat; }
+  uint8_t getCGREGStat() const { return _cgregStat; }
+  bool isRegistered();
+  bool isCallReady() const { return _callReady; }
+  int getNewSMSIndex();
+  bool getNetworkTime(uint32_t & ts);
+  // Let the modem keep received TCP data until we ask for it (AT+CIPRXGET=1)
+  // Must be set before openTCP. Not for transparent mode.
+  void setTCPRxGet(bool x=true)         { _tcpRxGet = x; }
+  // Use AT+CIPQSEND=1 for openTCP, optionally without "> " prompt (AT+CIPSPRT=0)
+  // Each segment still waits for its DATA ACCEPT, there is no send window.
+  // Must be set before openTCP. Not for transparent mode.
+  void setTCPQuickSend(bool x=true, bool prompt=true) { _tcpQuickSend = x; _tcpSendPrompt = prompt; }
+
+  // Transparent mode (openTCP with transMode=true)
+  // Packing interval in units of 200 ms (1..10) and send size (AT+CIPCCFG)
+  void setTransparentConfig(uint8_t waitTm, uint16_t sendSz) { _transWaitTm = waitTm; _transSendSz = sendSz; }
+  // The time without data that the modem needs around "+++"
+  void setEscapeGuardTime(uint16_t ms)  { _escapeGuardTime = ms; }
+  size_t transparentPump(Stream & stream, uint16_t idleTimeout=1000);
 
   bool openFTP(const char *apn, const char *server,
       const char *username, const char *password);
@@ -155,10 +473,21 @@ public:
 
   bool sendSMS(const char *telno, const char *text);
 
+  // Switch to this baud rate (AT+IPR) before the first network operation
+  // after switching on. The callback of enableBaudrateChange() must
+  // re-open the modem stream. 0 is don't change.
+  void setBaudrate(uint32_t rate) { _targetBaudrate = rate; }
+  // The baud rate of the modem stream, as far as we know
+  uint32_t getBaudrate() { return _baudrate != 0 ? _baudrate : getDefaultBaudrate(); }
+  // When switching on, try these baud rates (through the callback of
+  // enableBaudrateChange) until the modem answers. The rate that worked
+  // last time is tried first. The array must stay valid. NULL is don't probe.
+  void setBaudrateProbe(const uint32_t *rates, uint8_t count) { _probeRates = rates; _probeRatesCount = rates ? count : 0; }
+
   /////////////////////
   // Sodaq_GSM_Modem //
   /////////////////////
-  uint32_t getDefaultBaudrate() { return 0; }
+  uint32_t getDefaultBaudrate() { return GPRSBEE_DEFAULT_BAUDRATE; }
 
   // Sets the apn, apn username and apn password to the modem.
   bool sendAPN(const char* apn, const char* username, const char* password);
@@ -178,6 +507,8 @@ public:
 
   // Get the Received Signal Strength Indication and Bit Error Rate
   bool getRSSIAndBER(int8_t* rssi, uint8_t* ber);
+  // Skip waitForSignalQuality when a good signal was seen less than this many ms ago (0 is never)
+  void setSignalQualitySkipTime(uint32_t ms) { _signalSkipTime = ms; }
 
   // Get the Operator Name
   bool getOperatorName(char* buffer, size_t size) { return false; }
@@ -186,24 +517,25 @@ public:
   bool getMobileDirectoryNumber(char* buffer, size_t size) { return false; }
 
   // Get International Mobile Station Identity
-  bool getIMSI(char* buffer, size_t size) { return false; }
+  bool getIMSI(char* buffer, size_t size) { return getCIMI(buffer, size); }
 
   // Get SIM status
   SimStatuses getSimStatus() { return SimStatusUnknown; }
 
-  // Get IP Address
-  IP_t getLocalIP() { return 0; }
+  // Get IP Address (of the bearer or of the multi connection mode)
+  IP_t getLocalIP() { return _localIP; }
 
   // Get Host IP
   IP_t getHostIP(const char* host) { return 0; }
 
   // ==== Sockets
 
-  int createSocket(Protocols protocol, uint16_t localPort = 0) { return false; }
-  bool connectSocket(uint8_t socket, const char* host, uint16_t port) { return false; }
-  bool socketSend(uint8_t socket, const uint8_t* buffer, size_t size) { return false; }
-  size_t socketReceive(uint8_t socket, uint8_t* buffer, size_t size) { return 0; } // returns number of bytes set to buffer
-  bool closeSocket(uint8_t socket) { return false; }
+  int createSocket(Protocols protocol, uint16_t localPort = 0);
+  bool connectSocket(uint8_t socket, const char* host, uint16_t port);
+  bool socketSend(uint8_t socket, const uint8_t* buffer, size_t size);
+  size_t socketReceive(uint8_t socket, uint8_t* buffer, size_t size); // returns number of bytes set to buffer
+  bool closeSocket(uint8_t socket);
+  bool isSocketConnected(uint8_t socket);
 
   // ==== HTTP
 
@@ -234,7 +566,12 @@ public:
   bool sendMQTTPacket(uint8_t * pckt, size_t len);
   bool receiveMQTTPacket(uint8_t * pckt, size_t expected_len);
 
+  // The identity is read once per power cycle, these are served from RAM
   bool getIMEI(char *buffer, size_t buflen);
+  bool getFirmware(char *buffer, size_t buflen);
+  const GPRSbeeIdentity * getIdentity();
+  // Optional, a stored identity with the same IMEI skips most of the probing
+  void setIdentityStore(GPRSbeeIdentityLoad load, GPRSbeeIdentitySave save) { _identityLoad = load; _identitySave = save; }
   bool getGCAP(char *buffer, size_t buflen);
   bool getCIMI(char *buffer, size_t buflen);
   bool getCCID(char *buffer, size_t buflen);
@@ -260,6 +597,12 @@ public:
   bool sendCommandWaitForOK(const String & cmd, uint16_t timeout=4000);
   bool sendCommandWaitForOK_P(const char *cmd, uint16_t timeout=4000);
 
+  // Non-blocking commands. Queue the command and call poll() until it is done.
+  bool queueCommand(GPRSbeeCommand & cmd);
+  bool queueCommand_P(GPRSbeeCommand & cmd);
+  bool poll();
+  bool waitForCommand(GPRSbeeCommand & cmd);
+
   // Using CCLK, get 32-bit number of seconds since Unix epoch (1970-01-01)
   uint32_t getUnixEpoch() const;
   // Using CCLK, get 32-bit number of seconds since Y2K epoch (2000-01-01)
@@ -268,6 +611,14 @@ public:
   // Getters of diagnostic values
   uint32_t getTimeToOpenTCP() { return _timeToOpenTCP; }
   uint32_t getTimeToCloseTCP() { return _timeToCloseTCP; }
+  uint32_t getTimeToDoHTTP() { return _timeToDoHTTP; }
+  uint32_t getTimeToOpenFTP() { return _timeToOpenFTP; }
+  uint32_t getTimeToCloseFTP() { return _timeToCloseFTP; }
+
+  // Number of bytes written to and read from the modem stream
+  uint32_t getTxCount() { return _txCount; }
+  uint32_t getRxCount() { return _rxCount; }
+  void resetTxRxCount() { _txCount = 0; _rxCount = 0; }
 
 private:
   void initProlog(Stream &stream, size_t bufferSize);
@@ -282,13 +633,21 @@ private:
   void offSwitchAutonomoSIM800();
 
   bool isAlive();
-  bool isOn();
+  bool probeBaudrate(uint16_t timeout);
+  bool changeBaudrate(uint32_t rate);
+  bool verifyLink();
   void toggle();
 
   void switchEchoOff();
+  // Read one byte from the modem, keeping track of the number of bytes
+  int modemRead() { int c = _modemStream->read(); if (c >= 0) { ++_rxCount; } return c; }
   void flushInput();
+  void waitForLineIdle(uint16_t idle, uint16_t maxWait);
   int readLine(uint32_t ts_max);
+  int pollLine();
   int readBytes(size_t len, uint8_t *buffer, size_t buflen, uint32_t ts_max);
+  bool readData(size_t len, Print * sink, GPRSbeeDataCallback callback, uint32_t ts_max);
+  bool doHTTPREADchunked(Print * sink, GPRSbeeDataCallback callback, size_t chunkSize);
   bool waitForOK(uint16_t timeout=4000);
   bool waitForMessage(const char *msg, uint32_t ts_max);
   bool waitForMessage_P(const char *msg, uint32_t ts_max);
@@ -303,9 +662,84 @@ private:
   void sendCommandAdd_P(const char *cmd);
   void sendCommandEpilog();
 
+  /*
+   * Send a command with its parameters, separated by commas. Strings are
+   * quoted, numbers are not. For example
+   *   sendCommandArgs_P(PSTR("AT+CIPSTART="), F("TCP"), server, port);
+   * sends
+   *   AT+CIPSTART="TCP","example.com",8500
+   * Everything is written straight to the modem, there is no command buffer
+   * that can be too small.
+   */
+  template<typename... Args>
+  void sendCommandArgs_P(const char *cmd, Args... args)
+  {
+    sendCommandProlog();
+    sendCommandAdd_P(cmd);
+    sendCommandParams(args...);
+    sendCommandEpilog();
+  }
+  void sendCommandParams() {}
+  template<typename T, typename... Args>
+  void sendCommandParams(T param, Args... args)
+  {
+    sendCommandParam(param);
+    if (sizeof...(args) > 0) {
+      sendCommandAdd(',');
+    }
+    sendCommandParams(args...);
+  }
+  void sendCommandParam(int value) { sendCommandParam((long)value); }
+  void sendCommandParam(unsigned int value) { sendCommandParam((unsigned long)value); }
+  void sendCommandParam(long value);
+  void sendCommandParam(unsigned long value);
+  void sendCommandParam(const char *str);
+  void sendCommandParam(const __FlashStringHelper *str);
+
+  /*
+   * Send a few commands as one line, AT+CMD1;+CMD2;+CMD3, to save the
+   * round trips. If the firmware does not accept that, the commands are
+   * sent one by one. The commands must not mind being sent twice.
+   *   for (batchBegin(); batchNext(); ) {
+   *     batchArgs_P(PSTR("+FTPSERV="), server);
+   *     batchArgs_P(PSTR("+FTPUN="), username);
+   *   }
+   *   if (!batchOK()) ...
+   */
+  void batchBegin() { _batchPass = 0; }
+  bool batchNext();
+  bool batchOK() const { return _batchOK; }
+  template<typename... Args>
+  void batchArgs_P(const char *cmd, Args... args)
+  {
+    if (!batchAdd_P(cmd)) {
+      return;
+    }
+    sendCommandParams(args...);
+    if (!_batchMode) {
+      sendCommandEpilog();
+      _batchOK = waitForOK();
+    }
+  }
+  bool batchAdd_P(const char *cmd);
+
+  void writeData(const uint8_t *data, size_t len);
+  void writeData(uint8_t (*read)(), size_t len);
+  bool writeData(GPRSbeeDataProducer producer, size_t len);
+
+  bool doHTTPPOST(const char *apn, const char *apnuser, const char *apnpwd,
+      const char *url, const char *postdata, GPRSbeeDataProducer producer, size_t pdlen);
+  bool doHTTPPOSTmiddle(const char *url, const char *postdata, GPRSbeeDataProducer producer, size_t pdlen);
+  bool doHTTPSessionPOST(const char *url, const char *postdata, GPRSbeeDataProducer producer, size_t pdlen);
+
   void sendCommand(const char *cmd);
   void sendCommand_P(const char *cmd);
 
+  bool enqueueCommand(GPRSbeeCommand & cmd);
+  void startCommand();
+  void handleCommandLine(GPRSbeeCommand & cmd);
+  void finishCommand();
+
   bool getIntValue(const char *cmd, const char *reply, int * value, uint32_t ts_max);
   bool getIntValue_P(const char *cmd, const char *reply, int * value, uint32_t ts_max);
   bool getStrValue(const char *cmd, const char *reply, char * str, size_t size, uint32_t ts_max);
@@ -314,11 +748,67 @@ private:
 
   bool connectProlog();
   bool waitForSignalQuality();
+  void addRSSI(int8_t rssi);
+  bool isSignalHopeful();
   bool waitForCREG();
+  bool enableRegistrationURC();
   bool setBearerParms(const char *apn, const char *user, const char *pwd);
+  bool isBearerOpen();
+  bool prepareHTTPSession();
+  bool recoverHTTPSession();
+  void checkHTTPSessionLinger();
+
+  void resetState();
+
+  bool openMUX();
+  void resetSockets();
+  const char * waitForSocketReply(uint8_t socket, uint32_t ts_max);
+  bool handleSocketLine();
+  size_t fetchSocketData(uint8_t socket, uint8_t *buffer, size_t size);
+
+  enum URCResults {
+    URCPass,                    // The line is still seen by the caller
+    URCConsumed,                // The line is not seen by the caller
+    URCAbort,                   // Abort the current wait (e.g. PDP deactivated)
+  };
+  typedef URCResults (GPRSbeeClass::*URCHandler)(char *arg);
+  struct URCEntry {
+    const char * prefix;        // In PROGMEM
+    URCHandler handler;
+  };
+  static const URCEntry _urcTable[];
+  URCResults handleURCLine();
+  URCResults handleURC_CIPRXGET(char *arg);
+  URCResults handleURC_CREG(char *arg);
+  URCResults handleURC_CGREG(char *arg);
+  URCResults handleURC_CMTI(char *arg);
+  URCResults handleURC_CLOSED(char *arg);
+  URCResults handleURC_DEACT(char *arg);
+  URCResults handleURC_RDY(char *arg);
+  URCResults handleURC_CallReady(char *arg);
+  URCResults handleURC_PSUTTZ(char *arg);
+
+  bool receiveDataTCPRxGet(uint8_t *data, size_t data_len, uint32_t ts_max);
+  bool fetchTCPData(size_t len);
+  bool waitForRxGetReply(uint32_t ts_max);
+
+  bool sendDataTCPQuick(const uint8_t *data, size_t data_len);
+  bool waitForDataAccept(size_t len, uint32_t ts_max);
+
+  bool switchToCommandMode();
+
+  void traceBegin(char type);
+  void traceAdd(const char *data, size_t len);
+  void traceAdd_P(const char *data);
+  void traceEnd();
+  bool tracePut(uint8_t c);
+  uint8_t traceGet(size_t pos) const { return _traceBuffer[pos % _traceSize]; }
+  size_t traceRead(size_t pos, char *type, uint32_t *ts, char *line, size_t *len) const;
 
   bool getPII(char *buffer, size_t buflen);
   void setProductId();
+  bool readIdentity();
+  bool copyIdentityField(const char *field, char *buffer, size_t buflen);
 
   // Small utility to see if we timed out
   bool isTimedOut(uint32_t ts) { return (long)(millis() - ts) >= 0; }
@@ -327,11 +817,20 @@ private:
 
   bool sendFTPdata_low(uint8_t *buffer, size_t size);
   bool sendFTPdata_low(uint8_t (*read)(), size_t size);
+  bool parseFTPPUT(uint8_t mode, int32_t *value);
 
   ResponseTypes readResponse(char* buffer, size_t size, size_t* outSize,
           uint32_t timeout = DEFAULT_READ_MS) { return ResponseNotFound; }
 
   size_t _ftpMaxLength;
+
+  // Command batches, see batchNext()
+  bool _batchMode;              // Sending AT+CMD1;+CMD2, not one by one
+  bool _batchOK;
+  bool _batchUnsupported;       // The firmware rejected a batch
+  bool _batchRejected;          // The last batch got an ERROR
+  uint8_t _batchPass;
+  uint8_t _batchCount;
   bool _transMode;
   bool _skipCGATT;
   bool _changedSkipCGATT;		// This is set when the user has changed it.
@@ -342,8 +841,98 @@ private:
   };
   enum productIdKind _productId;
 
+  GPRSbeeIdentity _identity;
+  bool _identityValid;          // Cleared when the modem is switched off
+  GPRSbeeIdentityLoad _identityLoad;
+  GPRSbeeIdentitySave _identitySave;
+
   uint32_t _timeToOpenTCP;
   uint32_t _timeToCloseTCP;
+  uint32_t _timeToDoHTTP;
+  uint32_t _timeToOpenFTP;
+  uint32_t _timeToCloseFTP;
+
+  uint32_t _txCount;
+  uint32_t _rxCount;
+
+  // The state of pollLine()
+  size_t _lineLen;
+  bool _lineSeenCR;
+  uint32_t _lineTsWaitLF;
+
+  GPRSbeeCommand * _commandQueue;
+  GPRSbeeCommand * _currentCommand;
+  bool _inWaitForCommand;       // poll() is called by a blocking function
+
+  bool _bearerOpen;             // SAPBR bearer 1 is open
+  IP_t _localIP;                // From +SAPBR: or AT+CIFSR
+  bool _httpInitDone;           // HTTPINIT was done
+  bool _httpSessionOpen;
+  uint32_t _httpSessionLinger;
+  uint32_t _httpSessionLastUse;
+
+  GPRSbeeUpload * _uploadQueue;
+  size_t _uploadQueueSize;
+  size_t _uploadCount;
+
+  // The <DataLen> of the last HTTPACTION
+  uint32_t _httpDataLen;
+  bool _httpDataLenKnown;
+
+  struct GPRSbeeSocket {
+    bool inUse;
+    bool connected;
+    bool dataPending;           // SIM900 said it has received data for us
+    Protocols protocol;
+    uint16_t localPort;
+  };
+  bool _muxOpen;                // AT+CIPMUX=1 and the PDP context is up
+  GPRSbeeSocket _sockets[GPRSBEE_MAX_SOCKETS];
+
+  uint32_t _baudrate;           // Of the modem stream, 0 is the default
+  uint32_t _targetBaudrate;     // See setBaudrate()
+  uint32_t _failedBaudrate;     // Don't try this one again
+  const uint32_t * _probeRates; // See setBaudrateProbe()
+  uint8_t _probeRatesCount;
+
+  bool _tcpRxGet;               // Use AT+CIPRXGET=1 for openTCP
+  bool _tcpDataPending;         // SIM900 said it has received data for us
+  uint8_t * _tcpRxBuffer;
+  GPRSbeeRingBuffer _tcpRx;
+
+  bool _tcpQuickSend;           // Use AT+CIPQSEND=1 for openTCP
+  bool _tcpSendPrompt;          // Wait for the "> " prompt (AT+CIPSPRT)
+  size_t _tcpMaxSend;           // Maximum length of one AT+CIPSEND
+
+  uint8_t _transWaitTm;
+  uint16_t _transSendSz;
+  uint16_t _escapeGuardTime;
+  uint32_t _transLastData;      // The last time data was sent or received in transparent mode
+
+  // Trace records: <type> <ts (4 bytes)> <len> <line>
+  uint8_t * _traceBuffer;
+  size_t _traceSize;
+  size_t _traceTail;            // The oldest record
+  size_t _traceUsed;
+  bool _traceOpen;              // A record is being added
+  size_t _traceRecord;          // The start of that record
+  GPRSbeeTraceCallback _traceCallback;
+
+  GPRSbeeURCCallback _urcCallback;
+  bool _tcpClosed;              // "CLOSED" was seen after openTCP
+  uint8_t _cregStat;
+  uint8_t _cgregStat;
+  bool _registrationURC;        // AT+CREG=1 was sent
+
+  int8_t _rssiHistory[GPRSBEE_CSQ_HISTORY];
+  uint8_t _rssiCount;
+  bool _goodSignalSeen;
+  uint32_t _goodSignalTs;       // When waitForSignalQuality last saw a good signal
+  uint32_t _signalSkipTime;
+  bool _callReady;
+  int _newSMSIndex;             // From +CMTI:, -1 if none
+  uint32_t _networkTime;        // Y2K epoch from *PSUTTZ:
+  uint32_t _networkTimeTs;      // millis() when *PSUTTZ: was seen, 0 if never
 
 };
 
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2013-2015 Kees Bakker.  All rights reserved.
+ *
+ * This file is part of GPRSbee.
+ *
+ * GPRSbee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * GPRSbee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GPRSbee.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "GPRSbeeFields.h"
+
+static char *skipSpaces(char *ptr)
+{
+  while (*ptr == ' ') {
+    ++ptr;
+  }
+  return ptr;
+}
+
+static bool isDigit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+GPRSbeeFields::GPRSbeeFields(char *line, bool skipPrefix)
+{
+  char *ptr = line;
+  if (skipPrefix) {
+    for (char *p = line; *p != '\0' && *p != ','; ++p) {
+      if (*p == ':') {
+        ptr = p + 1;
+        break;
+      }
+    }
+  }
+  ptr = skipSpaces(ptr);
+  _ptr = *ptr != '\0' ? ptr : 0;
+}
+
+/*
+ * \brief Find the end of the field that starts at \a ptr
+ *
+ * A comma inside quotes does not end the field.
+ *
+ * \return a pointer to the ',' after the field, or to the terminating NUL
+ */
+char *GPRSbeeFields::fieldEnd(char *ptr)
+{
+  if (*ptr == '"') {
+    char *quote = strchr(ptr + 1, '"');
+    if (quote != 0) {
+      ptr = quote + 1;
+    }
+  }
+  while (*ptr != '\0' && *ptr != ',') {
+    ++ptr;
+  }
+  return ptr;
+}
+
+void GPRSbeeFields::advance(char *end)
+{
+  _ptr = *end == ',' ? skipSpaces(end + 1) : 0;
+}
+
+bool GPRSbeeFields::nextInt(int32_t *value)
+{
+  if (_ptr == 0) {
+    return false;
+  }
+  char *ptr = _ptr;
+  if (*ptr == '"') {
+    ++ptr;
+  }
+  char *numEnd;
+  long v = strtol(ptr, &numEnd, 10);
+  if (numEnd == ptr) {
+    // Not a number
+    return false;
+  }
+  *value = v;
+  advance(fieldEnd(_ptr));
+  return true;
+}
+
+char *GPRSbeeFields::nextStr()
+{
+  if (_ptr == 0) {
+    return 0;
+  }
+  char *start = _ptr;
+  char *end = fieldEnd(start);
+  advance(end);
+  *end = '\0';
+  if (*start == '"') {
+    ++start;
+    char *quote = strchr(start, '"');
+    if (quote != 0) {
+      *quote = '\0';
+    }
+  }
+  return start;
+}
+
+bool GPRSbeeFields::nextIP(uint32_t *ip)
+{
+  if (_ptr == 0) {
+    return false;
+  }
+  char *ptr = _ptr;
+  if (*ptr == '"') {
+    ++ptr;
+  }
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (i > 0) {
+      if (*ptr != '.') {
+        return false;
+      }
+      ++ptr;
+    }
+    if (!isDigit(*ptr)) {
+      return false;
+    }
+    char *octetEnd;
+    unsigned long octet = strtoul(ptr, &octetEnd, 10);
+    if (octet > 255) {
+      return false;
+    }
+    value = (value << 8) | octet;
+    ptr = octetEnd;
+  }
+  *ip = value;
+  advance(fieldEnd(_ptr));
+  return true;
+}
+
+bool GPRSbeeFields::skip(uint8_t count)
+{
+  while (count-- > 0) {
+    if (_ptr == 0) {
+      return false;
+    }
+    advance(fieldEnd(_ptr));
+  }
+  return true;
+}
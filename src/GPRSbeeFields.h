@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013-2015 Kees Bakker.  All rights reserved.
+ *
+ * This file is part of GPRSbee.
+ *
+ * GPRSbee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * GPRSbee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GPRSbee.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPRSBEEFIELDS_H_
+#define GPRSBEEFIELDS_H_
+
+#include <stdint.h>
+
+/*!
+ * \brief Split a reply of the SIMx00 into its fields, in place
+ *
+ * A reply looks like this:
+ *   +HTTPACTION: 0,200,1234
+ *   +SAPBR: 1,1,"10.81.112.23"
+ *
+ * The prefix up to the ':' is skipped, and so are the spaces after it.
+ * SIM900 often leaves out the space (+FTPPUT:1,1,1360), SIM800 does not
+ * (+FTPPUT: 1,1,1360), so the fields are never found at a fixed offset.
+ *
+ * Nothing is copied. nextInt() and nextIP() only read the line. nextStr()
+ * terminates the field in the line itself, so after that the line is cut.
+ */
+class GPRSbeeFields
+{
+public:
+  /*!
+   * \brief Start at the first field of \a line
+   *
+   * If \a skipPrefix is true, everything up to and including a ':' is
+   * skipped, but only if that ':' comes before the first ','.
+   */
+  GPRSbeeFields(char *line, bool skipPrefix = true);
+
+  // Returns true if there are no more fields
+  bool atEnd() const { return _ptr == 0; }
+
+  // Read the next field as a number (quoted or not). Anything after the
+  // number is ignored. If the field is not a number it is not skipped.
+  bool nextInt(int32_t *value);
+
+  // Return the next field, without the quotes. The field is terminated in
+  // place. Returns NULL if there are no more fields.
+  char *nextStr();
+
+  // Read the next field as an IP address a.b.c.d (quoted or not). If the
+  // field is not an IP address it is not skipped.
+  bool nextIP(uint32_t *ip);
+
+  // Skip one or more fields. Returns false if there were not enough.
+  bool skip(uint8_t count = 1);
+
+  // The rest of the line, from the next field on. Returns "" at the end.
+  const char *rest() const { return _ptr ? _ptr : ""; }
+
+private:
+  char *fieldEnd(char *ptr);
+  void advance(char *end);
+
+  // The start of the next field, or NULL if there is none
+  char *_ptr;
+};
+
+#endif /* GPRSBEEFIELDS_H_ */
@@ -20,15 +20,28 @@
 
 #include "Sodaq_GSM_Modem.h"
 
-#define DEBUG
-
-#ifdef DEBUG
-#define debugPrintLn(...) { if (this->_diagStream) this->_diagStream->println(__VA_ARGS__); }
-#define debugPrint(...) { if (this->_diagStream) this->_diagStream->print(__VA_ARGS__); }
-#warning "Debug mode is ON"
+// debugError(GPRSBEE_DIAG_POWER, ...) etc. compile to nothing when the level
+// or the category is disabled (see GPRSBEE_DIAG_LEVEL)
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_ERROR
+#define debugError(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define debugErrorLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
+#else
+#define debugError(...)
+#define debugErrorLn(...)
+#endif
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_INFO
+#define debugInfo(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define debugInfoLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
+#else
+#define debugInfo(...)
+#define debugInfoLn(...)
+#endif
+#if GPRSBEE_DIAG_LEVEL >= GPRSBEE_DIAG_DEBUG
+#define debugPrint(...) GPRSBEE_DIAG_PRINT(__VA_ARGS__)
+#define debugPrintLn(...) GPRSBEE_DIAG_PRINTLN(__VA_ARGS__)
 #else
-#define debugPrintLn(...)
 #define debugPrint(...)
+#define debugPrintLn(...)
 #endif
 
 #define CR "\r"
@@ -61,9 +74,22 @@ Sodaq_GSM_Modem::Sodaq_GSM_Modem() :
     _appendCommand(false),
     _lastRSSI(0),
     _CSQtime(0),
+    _CREGtime(0),
     _minSignalQuality(-93)      // -93 dBm
 {
     this->_isBufferInitialized = false;
+    resetPhaseStats();
+
+    _energyState = EnergyOff;
+    _energyStateStart = 0;
+    _energyCurrent[EnergyAttaching] = MODEM_CURRENT_ATTACHING;
+    _energyCurrent[EnergyIdle] = MODEM_CURRENT_IDLE;
+    _energyCurrent[EnergyTransmitting] = MODEM_CURRENT_TRANSMITTING;
+    _energyCurrent[EnergyReceiving] = MODEM_CURRENT_RECEIVING;
+    memset(_stateTime, 0, sizeof(_stateTime));
+    _operationCharge = 0;
+    _operationChargeRest = 0;
+    resetTotalCharge();
 }
 
 // Turns the modem on and returns true if successful.
@@ -71,13 +97,24 @@ bool Sodaq_GSM_Modem::on()
 {
     _startOn = millis();
 
+    if (_energyState == EnergyOff) {
+        // A new operation
+        memset(_stateTime, 0, sizeof(_stateTime));
+        _operationCharge = 0;
+        _operationChargeRest = 0;
+        _energyStateStart = _startOn;
+        _energyState = EnergyAttaching;
+    }
+
     if (!isOn()) {
         if (_onoff) {
             _onoff->on();
+            recordPhase(PhasePowerOn, _startOn);
         }
     }
 
     // wait for power up
+    uint32_t start = millis();
     bool timeout = true;
     for (uint8_t i = 0; i < 10; i++) {
         if (isAlive()) {
@@ -85,9 +122,10 @@ bool Sodaq_GSM_Modem::on()
             break;
         }
     }
+    recordPhase(PhaseAlive, start);
 
     if (timeout) {
-        debugPrintLn("Error: No Reply from Modem");
+        debugErrorLn(GPRSBEE_DIAG_POWER, "Error: No Reply from Modem");
         return false;
     }
 
@@ -103,6 +141,8 @@ bool Sodaq_GSM_Modem::off()
     }
 
     _echoOff = false;
+    resetState();
+    setEnergyState(EnergyOff);
 
     return !isOn();
 }
@@ -121,7 +161,7 @@ bool Sodaq_GSM_Modem::isOn() const
 void Sodaq_GSM_Modem::writeProlog()
 {
     if (!_appendCommand) {
-        debugPrint(">> ");
+        debugPrint(GPRSBEE_DIAG_AT, ">> ");
         _appendCommand = true;
     }
 }
@@ -135,7 +175,7 @@ size_t Sodaq_GSM_Modem::writeByte(uint8_t value)
 size_t Sodaq_GSM_Modem::print(const String& buffer)
 {
     writeProlog();
-    debugPrint(buffer);
+    debugPrint(GPRSBEE_DIAG_AT, buffer);
 
     return _modemStream->print(buffer);
 }
@@ -143,7 +183,7 @@ size_t Sodaq_GSM_Modem::print(const String& buffer)
 size_t Sodaq_GSM_Modem::print(const char buffer[])
 {
     writeProlog();
-    debugPrint(buffer);
+    debugPrint(GPRSBEE_DIAG_AT, buffer);
 
     return _modemStream->print(buffer);
 }
@@ -151,7 +191,7 @@ size_t Sodaq_GSM_Modem::print(const char buffer[])
 size_t Sodaq_GSM_Modem::print(char value)
 {
     writeProlog();
-    debugPrint(value);
+    debugPrint(GPRSBEE_DIAG_AT, value);
 
     return _modemStream->print(value);
 };
@@ -159,7 +199,7 @@ size_t Sodaq_GSM_Modem::print(char value)
 size_t Sodaq_GSM_Modem::print(unsigned char value, int base)
 {
     writeProlog();
-    debugPrint(value, base);
+    debugPrint(GPRSBEE_DIAG_AT, value, base);
 
     return _modemStream->print(value, base);
 };
@@ -167,7 +207,7 @@ size_t Sodaq_GSM_Modem::print(unsigned char value, int base)
 size_t Sodaq_GSM_Modem::print(int value, int base)
 {
     writeProlog();
-    debugPrint(value, base);
+    debugPrint(GPRSBEE_DIAG_AT, value, base);
 
     return _modemStream->print(value, base);
 };
@@ -175,7 +215,7 @@ size_t Sodaq_GSM_Modem::print(int value, int base)
 size_t Sodaq_GSM_Modem::print(unsigned int value, int base)
 {
     writeProlog();
-    debugPrint(value, base);
+    debugPrint(GPRSBEE_DIAG_AT, value, base);
 
     return _modemStream->print(value, base);
 };
@@ -183,7 +223,7 @@ size_t Sodaq_GSM_Modem::print(unsigned int value, int base)
 size_t Sodaq_GSM_Modem::print(long value, int base)
 {
     writeProlog();
-    debugPrint(value, base);
+    debugPrint(GPRSBEE_DIAG_AT, value, base);
 
     return _modemStream->print(value, base);
 };
@@ -191,7 +231,7 @@ size_t Sodaq_GSM_Modem::print(long value, int base)
 size_t Sodaq_GSM_Modem::print(unsigned long value, int base)
 {
     writeProlog();
-    debugPrint(value, base);
+    debugPrint(GPRSBEE_DIAG_AT, value, base);
 
     return _modemStream->print(value, base);
 };
@@ -257,7 +297,7 @@ size_t Sodaq_GSM_Modem::println(unsigned long num, int base)
 size_t Sodaq_GSM_Modem::println(double num, int digits)
 {
     writeProlog();
-    debugPrint(num, digits);
+    debugPrint(GPRSBEE_DIAG_AT, num, digits);
 
     return _modemStream->println(num, digits);
 }
@@ -270,7 +310,7 @@ size_t Sodaq_GSM_Modem::println(const Printable& x)
 
 size_t Sodaq_GSM_Modem::println(void)
 {
-    debugPrintLn();
+    debugPrintLn(GPRSBEE_DIAG_AT);
     size_t i = print('\r');
     _appendCommand = false;
     return i;
@@ -280,7 +320,7 @@ size_t Sodaq_GSM_Modem::println(void)
 // Safe to call multiple times.
 void Sodaq_GSM_Modem::initBuffer()
 {
-    debugPrintLn("[initBuffer]");
+    debugPrintLn(GPRSBEE_DIAG_AT, "[initBuffer]");
 
     // make sure the buffers are only initialized once
     if (!_isBufferInitialized) {
@@ -426,3 +466,119 @@ size_t Sodaq_GSM_Modem::readLn(char* buffer, size_t size, uint32_t timeout)
 
     return len;
 }
+
+static const uint16_t phaseBucketLimits[MODEM_PHASE_BUCKETS - 1] PROGMEM = {
+    100, 300, 1000, 3000, 10000, 30000, 60000
+};
+
+static const char phaseName0[] PROGMEM = "PowerOn";
+static const char phaseName1[] PROGMEM = "Alive";
+static const char phaseName2[] PROGMEM = "CSQ";
+static const char phaseName3[] PROGMEM = "CREG";
+static const char phaseName4[] PROGMEM = "CGATT";
+static const char phaseName5[] PROGMEM = "Bearer";
+static const char phaseName6[] PROGMEM = "Action";
+static const char phaseName7[] PROGMEM = "Data";
+static const char * const phaseNames[ModemPhasesMAX + 1] PROGMEM = {
+    phaseName0, phaseName1, phaseName2, phaseName3,
+    phaseName4, phaseName5, phaseName6, phaseName7,
+};
+
+// Returns the upper limit (ms) of a histogram bucket. The last bucket has no limit.
+uint32_t Sodaq_GSM_Modem::getPhaseBucketLimit(uint8_t bucket)
+{
+    if (bucket >= MODEM_PHASE_BUCKETS - 1) {
+        return 0xFFFFFFFF;
+    }
+    return pgm_read_word(&phaseBucketLimits[bucket]);
+}
+
+void Sodaq_GSM_Modem::resetPhaseStats()
+{
+    memset(_phaseTime, 0, sizeof(_phaseTime));
+    memset(_phaseHistogram, 0, sizeof(_phaseHistogram));
+}
+
+void Sodaq_GSM_Modem::recordPhase(ModemPhases phase, uint32_t start)
+{
+    uint32_t duration = millis() - start;
+    _phaseTime[phase] = duration;
+
+    uint8_t bucket = 0;
+    while (duration > getPhaseBucketLimit(bucket)) {
+        ++bucket;
+    }
+    if (_phaseHistogram[phase][bucket] < 0xFFFF) {
+        ++_phaseHistogram[phase][bucket];
+    }
+}
+
+// Prints for each phase the last duration and the histogram, for example
+//   CREG 2150 0 0 3 12 1 0 0 0
+void Sodaq_GSM_Modem::dumpPhaseStats(Stream & stream)
+{
+    for (uint8_t phase = 0; phase <= ModemPhasesMAX; ++phase) {
+        stream.print((const __FlashStringHelper *)pgm_read_ptr(&phaseNames[phase]));
+        stream.print(' ');
+        stream.print(_phaseTime[phase]);
+        for (uint8_t bucket = 0; bucket < MODEM_PHASE_BUCKETS; ++bucket) {
+            stream.print(' ');
+            stream.print(_phaseHistogram[phase][bucket]);
+        }
+        stream.println();
+    }
+}
+
+void Sodaq_GSM_Modem::setEnergyState(ModemEnergyStates state)
+{
+    if (_energyState == EnergyOff) {
+        // Only on() can start a new operation
+        return;
+    }
+    accountEnergy();
+    _energyState = state;
+}
+
+void Sodaq_GSM_Modem::accountEnergy()
+{
+    uint32_t now = millis();
+    uint32_t ms = now - _energyStateStart;
+    _energyStateStart = now;
+    if (_energyState == EnergyOff) {
+        return;
+    }
+
+    _stateTime[_energyState] += ms;
+
+    // 1 uAh is 3.6 mA*s or 3600 mA*ms. ms * mA overflows after a few hours
+    // in one state, so the whole seconds are done in mA*s, which is 5/18 uAh.
+    // The rest in mA*ms is kept for the next time.
+    uint16_t mA = _energyCurrent[_energyState];
+    uint32_t mAs = (ms / 1000) * mA;
+    uint32_t uAh = mAs / 18 * 5;
+    uint32_t charge = (ms % 1000) * mA + (mAs % 18) * 1000;
+    uint32_t sum = charge + _operationChargeRest;
+    _operationCharge += uAh + sum / 3600;
+    _operationChargeRest = sum % 3600;
+    sum = charge + _totalChargeRest;
+    _totalCharge += uAh + sum / 3600;
+    _totalChargeRest = sum % 3600;
+}
+
+uint32_t Sodaq_GSM_Modem::getStateTime(ModemEnergyStates state)
+{
+    accountEnergy();
+    return _stateTime[state];
+}
+
+uint32_t Sodaq_GSM_Modem::getOperationCharge()
+{
+    accountEnergy();
+    return _operationCharge;
+}
+
+uint32_t Sodaq_GSM_Modem::getTotalCharge()
+{
+    accountEnergy();
+    return _totalCharge;
+}
@@ -87,6 +87,85 @@ enum ResponseTypes {
     ResponseEmpty = 5,
 };
 
+// Phases of a network operation (see getPhaseTime()).
+enum ModemPhases {
+    PhasePowerOn = 0,
+    PhaseAlive,
+    PhaseCSQ,
+    PhaseCREG,
+    PhaseCGATT,
+    PhaseBearer,
+    PhaseAction,
+    PhaseData,
+    ModemPhasesMAX = PhaseData,
+};
+
+// The number of buckets of the histogram of each phase.
+// The upper limits are 100, 300 ms, 1, 3, 10, 30, 60 s and "more".
+#define MODEM_PHASE_BUCKETS 8
+
+// States of the modem for the energy accounting (see setEnergyCurrent()).
+enum ModemEnergyStates {
+    EnergyAttaching = 0,        // From on() until the bearer is up
+    EnergyIdle,                 // Registered, nothing going on
+    EnergyTransmitting,
+    EnergyReceiving,
+    ModemEnergyStatesMAX = EnergyReceiving,
+    EnergyOff,
+};
+
+// Default currents (mA) of each state. These are rough figures for SIM800,
+// averaged over the GSM bursts.
+#ifndef MODEM_CURRENT_ATTACHING
+#define MODEM_CURRENT_ATTACHING 80
+#endif
+#ifndef MODEM_CURRENT_IDLE
+#define MODEM_CURRENT_IDLE 20
+#endif
+#ifndef MODEM_CURRENT_TRANSMITTING
+#define MODEM_CURRENT_TRANSMITTING 300
+#endif
+#ifndef MODEM_CURRENT_RECEIVING
+#define MODEM_CURRENT_RECEIVING 80
+#endif
+
+// Diagnostic levels. Messages above GPRSBEE_DIAG_LEVEL are not compiled in.
+#define GPRSBEE_DIAG_NONE       0
+#define GPRSBEE_DIAG_ERROR      1       // Failures (openTCP failed!, ...)
+#define GPRSBEE_DIAG_INFO       2       // Noteworthy events (bearer dropped, timeouts, ...)
+#define GPRSBEE_DIAG_DEBUG      3       // All AT traffic
+
+// Diagnostic categories, a bit mask. Messages of the categories not in
+// GPRSBEE_DIAG_CATEGORIES are not compiled in.
+#define GPRSBEE_DIAG_AT         0x01    // AT commands and replies
+#define GPRSBEE_DIAG_TCP        0x02
+#define GPRSBEE_DIAG_HTTP       0x04
+#define GPRSBEE_DIAG_FTP        0x08
+#define GPRSBEE_DIAG_POWER      0x10    // Switching on/off, signal and registration
+#define GPRSBEE_DIAG_ALL        0x1F
+
+// Define these (e.g. with -D in the build flags) to select the diagnostics.
+// The diag stream of setDiag() is still needed to see any of it.
+// The old ENABLE_GPRSBEE_DIAG=0 still switches everything off.
+#ifndef GPRSBEE_DIAG_LEVEL
+#if defined(ENABLE_GPRSBEE_DIAG) && !ENABLE_GPRSBEE_DIAG
+#define GPRSBEE_DIAG_LEVEL      GPRSBEE_DIAG_NONE
+#else
+#define GPRSBEE_DIAG_LEVEL      GPRSBEE_DIAG_ERROR
+#endif
+#endif
+#ifndef GPRSBEE_DIAG_CATEGORIES
+#define GPRSBEE_DIAG_CATEGORIES GPRSBEE_DIAG_ALL
+#endif
+
+// Helpers for the diag macros. A message is only compiled in when both its
+// level and its category are enabled. The level is filtered by the
+// preprocessor, the category by a constant condition.
+#define GPRSBEE_DIAG_PRINT(cat, ...) \
+    { if ((GPRSBEE_DIAG_CATEGORIES & (cat)) && this->_diagStream) this->_diagStream->print(__VA_ARGS__); }
+#define GPRSBEE_DIAG_PRINTLN(cat, ...) \
+    { if ((GPRSBEE_DIAG_CATEGORIES & (cat)) && this->_diagStream) this->_diagStream->println(__VA_ARGS__); }
+
 // IP type
 typedef uint32_t IP_t;
 
@@ -162,9 +241,30 @@ public:
 
     void setMinSignalQuality(int q);
     uint8_t getCSQtime() const { return _CSQtime; }
+    uint8_t getCREGtime() const { return _CREGtime; }
 
     uint8_t getLastRSSI() const { return _lastRSSI; }
 
+    // The number of ms the phase took the last time, 0 if not done yet.
+    uint32_t getPhaseTime(ModemPhases phase) const { return _phaseTime[phase]; }
+    // The number of times the phase took at most getPhaseBucketLimit(bucket) ms.
+    uint16_t getPhaseCount(ModemPhases phase, uint8_t bucket) const { return _phaseHistogram[phase][bucket]; }
+    static uint32_t getPhaseBucketLimit(uint8_t bucket);
+    void resetPhaseStats();
+    // Print the timing of all phases, one line per phase.
+    void dumpPhaseStats(Stream & stream);
+
+    // Sets the current (mA) that the modem draws in a state.
+    void setEnergyCurrent(ModemEnergyStates state, uint16_t mA) { _energyCurrent[state] = mA; }
+    // The number of ms spent in a state since the last on().
+    uint32_t getStateTime(ModemEnergyStates state);
+    // The estimated charge in uAh (1000 uAh is 1 mAh) since the last on(),
+    // i.e. of the current or the last operation.
+    uint32_t getOperationCharge();
+    // The estimated charge in uAh since the start or since resetTotalCharge().
+    uint32_t getTotalCharge();
+    void resetTotalCharge() { _totalCharge = 0; _totalChargeRest = 0; }
+
     // Returns the current status of the network.
     virtual NetworkRegistrationStatuses getNetworkStatus() = 0;
 
@@ -358,6 +458,9 @@ protected:
     // This is the number of second it took when CSQ was record last
     uint8_t _CSQtime;
 
+    // This is the number of seconds from on() to the network registration
+    uint8_t _CREGtime;
+
     // This is the minimum required CSQ to continue making the connection
     int _minSignalQuality;
 
@@ -367,6 +470,28 @@ protected:
     // Keep track when connect started. Use this to record various status changes.
     uint32_t _startOn;
 
+    // The duration of each phase, the last one and a histogram.
+    uint32_t _phaseTime[ModemPhasesMAX + 1];
+    uint16_t _phaseHistogram[ModemPhasesMAX + 1][MODEM_PHASE_BUCKETS];
+
+    // Record the duration of a phase that started at "start" (millis).
+    void recordPhase(ModemPhases phase, uint32_t start);
+
+    // Energy accounting
+    ModemEnergyStates _energyState;
+    uint32_t _energyStateStart;
+    uint16_t _energyCurrent[ModemEnergyStatesMAX + 1];
+    uint32_t _stateTime[ModemEnergyStatesMAX + 1];
+    uint32_t _operationCharge;
+    uint16_t _operationChargeRest;      // mA*ms, less than 3600
+    uint32_t _totalCharge;
+    uint16_t _totalChargeRest;
+
+    // Switch to another state for the energy accounting.
+    void setEnergyState(ModemEnergyStates state);
+    // Add the time since the last state change to the current state.
+    void accountEnergy();
+
     // Initializes the input buffer and makes sure it is only initialized once.
     // Safe to call multiple times.
     void initBuffer();
@@ -379,6 +504,9 @@ protected:
 
     virtual void switchEchoOff() = 0;
 
+    // Is called by off(). Forget the state that was set up in the modem.
+    virtual void resetState() {}
+
     // Sets the modem stream.
     void setModemStream(Stream& stream);
 